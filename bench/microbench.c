@@ -0,0 +1,457 @@
+/* Microbenchmarks for the SSDP compose, parse and lookup functions
+ *
+ * Copyright (c) 2017  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.a
+ */
+
+/*
+ * Each case runs for a fixed time budget and reports ns/op and heap
+ * allocations per op.  Results are also sanity checked, so this runs
+ * as part of `make check` and fails if a function misbehaves.
+ */
+
+#include <config.h>
+#include <err.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "ssdp.h"
+
+static const char *msearch =
+	"M-SEARCH * HTTP/1.1\r\n"
+	"HOST: 239.255.255.250:1900\r\n"
+	"MAN: \"ssdp:discover\"\r\n"
+	"MX: 1\r\n"
+	"ST: urn:schemas-upnp-org:device:InternetGatewayDevice:1\r\n"
+	"USER-AGENT: Microsoft Edge/91.0.864.59 Windows\r\n"
+	"\r\n";
+
+static const char *notify =
+	"NOTIFY * HTTP/1.1\r\n"
+	"HOST: 239.255.255.250:1900\r\n"
+	"CACHE-CONTROL: max-age=1800\r\n"
+	"LOCATION: http://192.168.1.1:1901/description.xml\r\n"
+	"NT: upnp:rootdevice\r\n"
+	"NTS: ssdp:alive\r\n"
+	"SERVER: Linux/5.10 UPnP/1.0 miniupnpd/2.2\r\n"
+	"USN: uuid:3d3cec3a-8cf0-11e0-98ee-001a6bd2d07b::upnp:rootdevice\r\n"
+	"\r\n";
+
+static int sizes[] = { 1, 16, 256, 1024 };
+static int budget = 50;			/* msec per case */
+
+static char   buf[SEND_PKT_SIZE];
+static char   pkt[MAX_PKT_SIZE];
+static struct sockaddr_storage cand;
+static struct ifsock *expect;
+
+/*
+ * Count heap allocations by interposing the glibc allocator, the
+ * functions under test should not need any.
+ */
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static size_t allocs;
+
+void *malloc(size_t size)
+{
+	allocs++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	allocs++;
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void run(const char *name, int num, void (*fn)(void))
+{
+	uint64_t start, elapsed, ops = 0, batch = 1;
+	size_t before = 0;
+	char n[16] = "-";
+
+	fn();			/* Warm up caches, and lazy init in libc */
+#ifdef __GLIBC__
+	before = allocs;
+#endif
+	start = now_ns();
+	do {
+		uint64_t i;
+
+		for (i = 0; i < batch; i++)
+			fn();
+		ops += batch;
+		if (batch < 4096)
+			batch *= 2;
+		elapsed = now_ns() - start;
+	} while (elapsed < (uint64_t)budget * 1000000);
+
+	if (num)
+		snprintf(n, sizeof(n), "%d", num);
+#ifdef __GLIBC__
+	printf("%-24s %6s %12.1f %12.2f\n", name, n, (double)elapsed / ops,
+	       (double)(allocs - before) / ops);
+#else
+	printf("%-24s %6s %12.1f %12s\n", name, n, (double)elapsed / ops, "n/a");
+#endif
+}
+
+static void bench_compose_response(void)
+{
+	compose_response("upnp:rootdevice", "192.168.1.1", buf, sizeof(buf));
+}
+
+static void bench_compose_response_uuid(void)
+{
+	compose_response(uuid, "192.168.1.1", buf, sizeof(buf));
+}
+
+static void bench_compose_reply(void)
+{
+	struct iovec iov[REPLY_IOV];
+
+	if (compose_reply(expect, "upnp:rootdevice", iov) != REPLY_IOV)
+		errx(1, "compose_reply() failed");
+}
+
+/* ssdp:all is answered with one reply per type, in one system call */
+static int batch_calls;
+
+static int batch_stub(int sd, struct mmsghdr *vec, unsigned int num, int flags)
+{
+	(void)sd;
+	(void)flags;
+
+	if (num != SSDP_TYPES - 1)
+		errx(1, "ssdp:all answered with %u replies", num);
+	batch_calls++;
+
+	return num;
+}
+
+static void bench_send_all(void)
+{
+	int before = batch_calls;
+
+	send_message(expect, SSDP_ST_ALL, (struct sockaddr *)&cand, NULL);
+	if (batch_calls != before + 1)
+		errx(1, "ssdp:all not sent as one batch");
+}
+
+static void bench_compose_notify(void)
+{
+	compose_notify(DEVICE_TYPE, "192.168.1.1", buf, sizeof(buf));
+}
+
+static void bench_compose_search(void)
+{
+	compose_search(SSDP_ST_ALL, buf, sizeof(buf));
+}
+
+/* Parsing NUL terminates the ST in place, restore it for the next op */
+static void bench_parse_msearch(void)
+{
+	char *type;
+
+	if (ssdp_parse(pkt, &type) != SSDP_MSEARCH || !type)
+		errx(1, "ssdp_parse() failed on M-SEARCH");
+	type[strlen(type)] = '\r';
+}
+
+static void bench_parse_notify(void)
+{
+	char *type;
+
+	if (ssdp_parse(pkt, &type) != SSDP_NOTIFY)
+		errx(1, "ssdp_parse() failed on NOTIFY");
+}
+
+static void bench_supported(void)
+{
+	if (!ssdp_supported(DEVICE_TYPE))
+		errx(1, "ssdp_supported() failed");
+}
+
+static void bench_find_outbound(void)
+{
+	if (find_outbound((struct sockaddr *)&cand) != expect)
+		errx(1, "find_outbound() returned wrong interface");
+}
+
+static void bench_find_outbound6(void)
+{
+	if (find_outbound6((struct sockaddr *)&cand) != expect)
+		errx(1, "find_outbound6() returned wrong interface");
+}
+
+static void bench_find_iface(void)
+{
+	if (find_iface((struct sockaddr *)&cand) != expect)
+		errx(1, "find_iface() returned wrong interface");
+}
+
+static void bench_web_render(void)
+{
+	static char xml[4096];
+	static FILE *fp;
+	struct sockaddr_in6 sin6;
+
+	/* Opened once, fmemopen() allocates */
+	if (!fp && !(fp = fmemopen(xml, sizeof(xml), "w")))
+		err(1, "fmemopen()");
+	rewind(fp);
+
+	memset(&sin6, 0, sizeof(sin6));
+	sin6.sin6_family = AF_INET6;
+	inet_pton(AF_INET6, "::ffff:192.168.1.1", &sin6.sin6_addr);
+	if (web_render(fp, (struct sockaddr *)&sin6) <= 0)
+		errx(1, "web_render() failed");
+}
+
+/*
+ * Timer wheel, first a check with simulated time: every timer must run
+ * in the first timer_run() at or after it expires, never before.  Then
+ * restart of one timer with num others running, in random slots.
+ */
+static struct timer timers[1024];
+static uint64_t     clock_now;
+static size_t       fired;
+
+static void timer_cb(void *arg, uint64_t now)
+{
+	struct timer *t = arg;
+
+	if (now < t->expires || clock_now > t->expires)
+		errx(1, "timer due at %llu ran at %llu", (unsigned long long)t->expires,
+		     (unsigned long long)now);
+	fired++;
+}
+
+static void timer_check(void)
+{
+	uint64_t start, next;
+	size_t i, num = sizeof(timers) / sizeof(timers[0]);
+
+	timer_init();
+	start = clock_now = timer_now();
+	for (i = 0; i < num; i++) {
+		uint64_t delay = rand() % (i & 1 ? 3000000 : 20000000);
+
+		timer_start(&timers[i], start + delay, timer_cb, &timers[i]);
+	}
+	for (i = 0; i < num; i += 7)
+		timer_stop(&timers[i]);
+	num -= (num + 6) / 7;
+
+	/* Step to each reported deadline, and at random in between */
+	while (timer_count()) {
+		next = timer_next();
+		if (next < clock_now)
+			errx(1, "timer_next() in the past");
+		if (rand() % 4 == 0)
+			next = clock_now + 1 + rand() % (next - clock_now + 1);
+
+		timer_run(next);
+		clock_now = next + 1;
+	}
+	if (fired != num)
+		errx(1, "%zu of %zu timers ran", fired, num);
+}
+
+/* Every value lands in the bucket whose range holds it */
+static void hist_check(void)
+{
+	uint64_t v;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS - 1; i++) {
+		if (hist_floor(i) >= hist_floor(i + 1))
+			errx(1, "hist bucket %d not above %d", i + 1, i);
+	}
+	for (v = 0; v < 1ULL << 40; v = v * 9 / 8 + 1) {
+		i = hist_bucket(v);
+		if (v < hist_floor(i) || (i < HIST_BUCKETS - 1 && v >= hist_floor(i + 1)))
+			errx(1, "%llu usec in hist bucket %d", (unsigned long long)v, i);
+	}
+}
+
+static void bench_timer_start(void)
+{
+	static size_t i;
+
+	i = (i + 1) % (sizeof(timers) / sizeof(timers[0]));
+	timer_start(&timers[i], clock_now + rand() % 600000, timer_cb, &timers[i]);
+}
+
+static void flush(void)
+{
+	free_sockets();
+}
+
+/*
+ * Synthetic interface table of num interfaces, 10.x.y.1/24 or
+ * 2001:db8:x::1.  The candidate matches the first one registered,
+ * i.e., the last in the list, the worst case for a linear search.
+ */
+static void table(int family, int num, int peer)
+{
+	struct sockaddr_storage addr, mask;
+	int i;
+
+	flush();
+	for (i = 0; i < num; i++) {
+		char ifname[IF_NAMESIZE];
+
+		memset(&addr, 0, sizeof(addr));
+		memset(&mask, 0, sizeof(mask));
+		if (family == AF_INET) {
+			struct sockaddr_in *sin = (struct sockaddr_in *)&addr;
+			struct sockaddr_in *msk = (struct sockaddr_in *)&mask;
+
+			sin->sin_family = AF_INET;
+			sin->sin_addr.s_addr = htonl(0x0a000001 | (i << 8));
+			msk->sin_family = AF_INET;
+			msk->sin_addr.s_addr = htonl(0xffffff00);
+		} else {
+			struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&addr;
+
+			sin6->sin6_family = AF_INET6;
+			inet_pton(AF_INET6, "2001:db8::1", &sin6->sin6_addr);
+			sin6->sin6_addr.s6_addr[4] = i >> 8;
+			sin6->sin6_addr.s6_addr[5] = i & 0xff;
+		}
+
+		snprintf(ifname, sizeof(ifname), "eth%d", i);
+		if (register_socket(-1, -1, ifname, (struct sockaddr *)&addr, (struct sockaddr *)&mask, NULL))
+			err(1, "Failed registering interface");
+		if (!i) {
+			expect = IFS_NEWEST();
+			cand = addr;
+		}
+	}
+
+	/* A peer on the same subnet, not our own address */
+	if (peer && family == AF_INET)
+		((struct sockaddr_in *)&cand)->sin_addr.s_addr = htonl(0x0a000064);
+}
+
+static int usage(int code)
+{
+	printf("Usage: microbench [-h] [-t MSEC]\n"
+	       "\n"
+	       "    -h        This help text\n"
+	       "    -t MSEC   Time budget per case, default %d msec\n", budget);
+
+	return code;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t i;
+	int c;
+
+	while ((c = getopt(argc, argv, "ht:")) != EOF) {
+		switch (c) {
+		case 'h':
+			return usage(0);
+
+		case 't':
+			budget = atoi(optarg);
+			if (budget <= 0)
+				return usage(1);
+			break;
+
+		default:
+			return usage(1);
+		}
+	}
+
+	strcpy(uuid, "uuid:3d3cec3a-8cf0-11e0-98ee-001a6bd2d07b");
+
+	printf("%-24s %6s %12s %12s\n", "BENCHMARK", "IFACES", "ns/op", "allocs/op");
+	run("compose_response", 0, bench_compose_response);
+	run("compose_response/uuid", 0, bench_compose_response_uuid);
+	table(AF_INET, 1, 0);
+	run("compose_reply", 0, bench_compose_reply);
+	ssdp_sendmmsg = batch_stub;
+	expect->out = 0;
+	run("send_message/ssdp:all", 0, bench_send_all);
+	expect->out = -1;
+	run("compose_notify", 0, bench_compose_notify);
+	run("compose_search", 0, bench_compose_search);
+
+	strcpy(pkt, msearch);
+	run("ssdp_parse/msearch", 0, bench_parse_msearch);
+	strcpy(pkt, notify);
+	run("ssdp_parse/notify", 0, bench_parse_notify);
+	run("ssdp_supported", 0, bench_supported);
+	run("web_render", 0, bench_web_render);
+
+	timer_check();
+	hist_check();
+	for (i = 0; i < sizeof(timers) / sizeof(timers[0]); i++)
+		bench_timer_start();
+	run("timer_start", sizeof(timers) / sizeof(timers[0]), bench_timer_start);
+	for (i = 0; i < sizeof(timers) / sizeof(timers[0]); i++)
+		timer_stop(&timers[i]);
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		table(AF_INET, sizes[i], 1);
+		run("find_outbound", sizes[i], bench_find_outbound);
+	}
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		table(AF_INET6, sizes[i], 0);
+		run("find_outbound6", sizes[i], bench_find_outbound6);
+	}
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		table(AF_INET, sizes[i], 0);
+		run("find_iface", sizes[i], bench_find_iface);
+	}
+	flush();
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
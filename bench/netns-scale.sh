@@ -0,0 +1,185 @@
+#!/bin/sh
+# Measure how ssdpd scales with the number of interfaces
+#
+# Creates a network namespace with N dummy interfaces, each with its own
+# /24, and a veth pair to a client namespace.  Without the dummy module
+# veth pairs are used instead, with the peers in a sink namespace.  ssdpd
+# runs on all of them and for each N we record:
+#
+#   start    msec from exec until the control socket answers, i.e., the
+#            first interface scan and announcement are done
+#   ifaces   interfaces (addresses) ssdpd registered
+#   refresh  CPU msec per interface refresh, averaged over two
+#   announce CPU msec per NOTIFY round, refresh subtracted
+#
+# CPU time has clock tick resolution, usually 10 msec.
+#   rss      resident set size in kiB
+#   fds      open file descriptors
+#   p50/p99  M-SEARCH reply latency in usec, from ssdp-bench
+#
+# Needs root, iproute2 and a built tree.  Runs offline, nothing leaves
+# the namespaces.  Takes about 40 sec per N.
+#
+# Usage: bench/netns-scale.sh [-b BUILDDIR] [-o SSDPD_OPTS] [N ...]
+
+BUILD=.
+OPTS=
+while getopts "b:ho:" opt; do
+	case $opt in
+		b) BUILD=$OPTARG ;;
+		o) OPTS=$OPTARG ;;
+		*) echo "Usage: $0 [-b BUILDDIR] [-o SSDPD_OPTS] [N ...]"; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+SIZES=${*:-"10 50 100 500 1000 5000"}
+
+SSDPD=$BUILD/ssdpd
+SSDPCTL=$BUILD/ssdpctl
+BENCH=$BUILD/ssdp-bench
+NSD=ssdpscale-d
+NSC=ssdpscale-c
+NSS=ssdpscale-s
+
+# Timing, must match the windows below: refresh every 7 sec, NOTIFY 30 sec
+REFRESH=7
+INTERVAL=30
+
+for prog in $SSDPD $SSDPCTL $BENCH; do
+	if [ ! -x "$prog" ]; then
+		echo "Missing $prog, build first, or use -b BUILDDIR" >&2
+		exit 1
+	fi
+done
+
+if [ "$(id -u)" != 0 ]; then
+	echo "Must run as root, creates network namespaces" >&2
+	exit 1
+fi
+
+# The control socket is in the file system, shared with the host
+if $SSDPCTL show >/dev/null 2>&1; then
+	echo "Another ssdpd is running, its control socket is in the way" >&2
+	exit 1
+fi
+
+now()
+{
+	date +%s%N | cut -c1-13
+}
+
+# utime + stime, in msec
+cpu()
+{
+	awk -v hz="$(getconf CLK_TCK)" '{ print int(($14 + $15) * 1000 / hz) }' /proc/$1/stat
+}
+
+cleanup()
+{
+	[ -n "$PID" ] && kill $PID 2>/dev/null && wait $PID 2>/dev/null
+	PID=
+	ip netns del $NSD 2>/dev/null
+	ip netns del $NSC 2>/dev/null
+	ip netns del $NSS 2>/dev/null
+}
+trap cleanup EXIT INT TERM
+
+setup()
+{
+	ip netns add $NSD
+	ip netns add $NSC
+	ip -n $NSD link set lo up
+	ip -n $NSC link set lo up
+
+	ip link add sd0 netns $NSD type veth peer name sc0 netns $NSC
+	ip -n $NSD addr add 10.255.0.1/24 dev sd0
+	ip -n $NSC addr add 10.255.0.2/24 dev sc0
+	ip -n $NSD link set sd0 up
+	ip -n $NSC link set sc0 up
+
+	# Batch mode, creating 5000 interfaces one command at a time is slow
+	if ip -n $NSD link add probe type dummy 2>/dev/null; then
+		ip -n $NSD link del probe
+		i=0
+		while [ $i -lt $1 ]; do
+			echo "link add d$i type dummy"
+			echo "link set d$i multicast on up"
+			echo "addr add 10.$((i / 256)).$((i % 256)).1/24 dev d$i"
+			i=$((i + 1))
+		done | ip -n $NSD -batch -
+	else
+		ip netns add $NSS
+		i=0
+		while [ $i -lt $1 ]; do
+			echo "link add d$i netns $NSD type veth peer name p$i netns $NSS"
+			i=$((i + 1))
+		done | ip -batch -
+		i=0
+		while [ $i -lt $1 ]; do
+			echo "link set p$i up"
+			i=$((i + 1))
+		done | ip -n $NSS -batch -
+		i=0
+		while [ $i -lt $1 ]; do
+			echo "link set d$i up"
+			echo "addr add 10.$((i / 256)).$((i % 256)).1/24 dev d$i"
+			i=$((i + 1))
+		done | ip -n $NSD -batch -
+	fi
+}
+
+run()
+{
+	n=$1
+
+	cleanup
+	setup $n
+
+	start=$(now)
+	ip netns exec $NSD $SSDPD -i $INTERVAL -r $REFRESH $OPTS &
+	PID=$!
+
+	# First refresh and announce are done before the main loop polls
+	while ! $SSDPCTL show >/dev/null 2>&1; do
+		if ! kill -0 $PID 2>/dev/null; then
+			printf "%6s  ssdpd died\n" $n
+			PID=
+			return
+		fi
+		sleep 0.01
+	done
+	startup=$(($(now) - start))
+	ifaces=$($SSDPCTL show interfaces | tail -n +2 | wc -l)
+
+	# Two refreshes, at 7 and 14 sec, nothing else
+	sleep 3
+	c0=$(cpu $PID)
+	sleep 12
+	c1=$(cpu $PID)
+	refresh=$(((c1 - c0) / 2))
+
+	ip netns exec $NSC $BENCH -i sc0 -d 3 -r 200 -c 8 > /tmp/ssdpscale.$$ 2>&1
+	p50=$(awk '/^Latency/ { print $5 }' /tmp/ssdpscale.$$ | tr -d ,)
+	p99=$(awk '/^Latency/ { print $7 }' /tmp/ssdpscale.$$ | tr -d ,)
+	rm -f /tmp/ssdpscale.$$
+
+	# Refresh at 28 and NOTIFY round at 30 sec
+	sleep 7
+	c0=$(cpu $PID)
+	sleep 8
+	c1=$(cpu $PID)
+	announce=$((c1 - c0 - refresh))
+	[ $announce -lt 0 ] && announce=0
+
+	rss=$(awk '/^VmRSS/ { print $2 }' /proc/$PID/status)
+	fds=$(ls /proc/$PID/fd | wc -l)
+
+	printf "%6s %8s %8s %8s %9s %8s %6s %8s %8s\n" $n $startup $ifaces \
+	       $refresh $announce $rss $fds ${p50:--} ${p99:--}
+	cleanup
+}
+
+printf "%6s %8s %8s %8s %9s %8s %6s %8s %8s\n" N START IFACES REFRESH ANNOUNCE RSS FDS P50 P99
+for n in $SIZES; do
+	run $n
+done
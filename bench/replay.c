@@ -0,0 +1,509 @@
+/* Replay captured SSDP traffic through the responder, offline
+ *
+ * Copyright (c) 2017  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.a
+ */
+
+/*
+ * Reads a classic pcap file, extracts all UDP datagrams to port 1900,
+ * and feeds them to ssdp_input() as fast as possible.  The interface
+ * table is synthetic, one interface per source /24 (IPv4) or one for
+ * all of IPv6, optionally with extra non-matching interfaces searched
+ * first.  Replies are captured by replacing ssdp_sendmsg() and
+ * ssdp_sendmmsg(), and can be written to a file, with the Date header
+ * masked, for diffing.
+ */
+
+#include <config.h>
+#include <err.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "ssdp.h"
+
+#define PCAP_MAGIC           0xa1b2c3d4
+#define PCAP_MAGIC_NSEC      0xa1b23c4d
+
+#define LINKTYPE_NULL        0
+#define LINKTYPE_ETHERNET    1
+#define LINKTYPE_RAW         101
+#define LINKTYPE_LINUX_SLL   113
+#define LINKTYPE_LINUX_SLL2  276
+
+struct pkt {
+	char   *data;
+	size_t  len;
+	struct sockaddr_storage from;
+};
+
+static struct pkt *pkts;
+static size_t      pkts_num;
+static size_t      pkts_max;
+
+static FILE    *out;
+static uint64_t replies, reply_bytes;
+
+static int swapped;
+
+static uint32_t get32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	if (swapped)
+		v = __builtin_bswap32(v);
+
+	return v;
+}
+
+static uint16_t get16be(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static void add(const unsigned char *data, size_t len, struct sockaddr_storage *from)
+{
+	if (pkts_num == pkts_max) {
+		struct pkt *tmp;
+
+		pkts_max = pkts_max ? pkts_max * 2 : 1024;
+		tmp = realloc(pkts, pkts_max * sizeof(*pkts));
+		if (!tmp)
+			err(1, "Failed allocating packets");
+		pkts = tmp;
+	}
+
+	/* Same as ssdp_recv(), truncate and NUL terminate */
+	if (len > MAX_PKT_SIZE - 1)
+		len = MAX_PKT_SIZE - 1;
+
+	pkts[pkts_num].data = malloc(len + 1);
+	if (!pkts[pkts_num].data)
+		err(1, "Failed allocating packet");
+	memcpy(pkts[pkts_num].data, data, len);
+	pkts[pkts_num].data[len] = 0;
+	pkts[pkts_num].len  = len;
+	pkts[pkts_num].from = *from;
+	pkts_num++;
+}
+
+/* UDP in IPv4 or IPv6, only unfragmented and without extension headers */
+static void ip(const unsigned char *p, size_t len, int sport)
+{
+	struct sockaddr_storage from;
+	const unsigned char *udp;
+	size_t hlen, ulen;
+
+	if (len < 1)
+		return;
+
+	memset(&from, 0, sizeof(from));
+	switch (p[0] >> 4) {
+	case 4: {
+		struct sockaddr_in *sin = (struct sockaddr_in *)&from;
+
+		hlen = (p[0] & 0x0f) * 4;
+		if (len < 20 || hlen < 20 || len < hlen + 8 || p[9] != IPPROTO_UDP)
+			return;
+		if (get16be(p + 6) & 0x3fff)
+			return;	/* Fragment */
+
+		sin->sin_family = AF_INET;
+		memcpy(&sin->sin_addr, p + 12, 4);
+		break;
+	}
+
+	case 6: {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&from;
+
+		hlen = 40;
+		if (len < hlen + 8 || p[6] != IPPROTO_UDP)
+			return;
+
+		sin6->sin6_family = AF_INET6;
+		memcpy(&sin6->sin6_addr, p + 8, 16);
+		break;
+	}
+
+	default:
+		return;
+	}
+
+	udp  = p + hlen;
+	ulen = get16be(udp + 4);
+	if (ulen < 8 || ulen > len - hlen)
+		return;
+
+	/* Queries and announcements, and with -n also replies to searches */
+	if (get16be(udp + 2) != MC_SSDP_PORT && !(sport && get16be(udp) == MC_SSDP_PORT))
+		return;
+
+	if (from.ss_family == AF_INET)
+		((struct sockaddr_in *)&from)->sin_port = htons(get16be(udp));
+	else
+		((struct sockaddr_in6 *)&from)->sin6_port = htons(get16be(udp));
+
+	add(udp + 8, ulen - 8, &from);
+}
+
+static void frame(int linktype, const unsigned char *p, size_t len, int sport)
+{
+	uint16_t proto;
+
+	switch (linktype) {
+	case LINKTYPE_NULL:
+		if (len < 4)
+			return;
+		ip(p + 4, len - 4, sport);
+		break;
+
+	case LINKTYPE_ETHERNET:
+		if (len < 14)
+			return;
+		proto = get16be(p + 12);
+		p += 14;
+		len -= 14;
+		while ((proto == 0x8100 || proto == 0x88a8) && len >= 4) {
+			proto = get16be(p + 2);
+			p += 4;
+			len -= 4;
+		}
+		if (proto == 0x0800 || proto == 0x86dd)
+			ip(p, len, sport);
+		break;
+
+	case LINKTYPE_LINUX_SLL:
+		if (len < 16)
+			return;
+		ip(p + 16, len - 16, sport);
+		break;
+
+	case LINKTYPE_LINUX_SLL2:
+		if (len < 20)
+			return;
+		ip(p + 20, len - 20, sport);
+		break;
+
+	case LINKTYPE_RAW:
+		ip(p, len, sport);
+		break;
+	}
+}
+
+static void load(char *file, int sport)
+{
+	unsigned char hdr[24], rec[16], *buf;
+	uint32_t magic, snaplen;
+	int linktype;
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (!fp)
+		err(1, "Failed opening %s", file);
+
+	if (fread(hdr, sizeof(hdr), 1, fp) != 1)
+		errx(1, "%s: too short for a pcap file", file);
+
+	memcpy(&magic, hdr, sizeof(magic));
+	if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NSEC)
+		swapped = 0;
+	else if (__builtin_bswap32(magic) == PCAP_MAGIC || __builtin_bswap32(magic) == PCAP_MAGIC_NSEC)
+		swapped = 1;
+	else
+		errx(1, "%s: not a pcap file, pcapng is not supported", file);
+
+	snaplen  = get32(hdr + 16);
+	linktype = get32(hdr + 20) & 0xffff;
+	if (snaplen < 65536)
+		snaplen = 65536;
+
+	buf = malloc(snaplen);
+	if (!buf)
+		err(1, "Failed allocating buffer");
+
+	while (fread(rec, sizeof(rec), 1, fp) == 1) {
+		uint32_t caplen = get32(rec + 8);
+
+		if (caplen > snaplen)
+			errx(1, "%s: corrupt record, caplen %u", file, caplen);
+		if (fread(buf, caplen, 1, fp) != 1)
+			break;
+
+		frame(linktype, buf, caplen, sport);
+	}
+
+	free(buf);
+	fclose(fp);
+}
+
+/* The table is searched newest first, so register fillers last */
+static void table(int fillers)
+{
+	struct sockaddr_storage addr, mask;
+	struct sockaddr_in *sin = (struct sockaddr_in *)&addr;
+	struct sockaddr_in *msk = (struct sockaddr_in *)&mask;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&addr;
+	char ifname[IF_NAMESIZE];
+	size_t i;
+	int num = 0, v6 = 0, sd;
+
+	/* Replies are captured, not sent, but need an outbound socket */
+	sd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sd < 0)
+		err(1, "Failed creating socket");
+
+	memset(&mask, 0, sizeof(mask));
+	msk->sin_family = AF_INET;
+	msk->sin_addr.s_addr = htonl(0xffffff00);
+
+	for (i = 0; i < pkts_num; i++) {
+		struct sockaddr *from = (struct sockaddr *)&pkts[i].from;
+		struct in_addr net;
+
+		if (from->sa_family == AF_INET6) {
+			v6 = 1;
+			continue;
+		}
+
+		net.s_addr = ((struct sockaddr_in *)from)->sin_addr.s_addr & msk->sin_addr.s_addr;
+		if (find_outbound(from))
+			continue;
+
+		memset(&addr, 0, sizeof(addr));
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = net.s_addr | htonl(254);
+		snprintf(ifname, sizeof(ifname), "eth%d", num++);
+		if (register_socket(-1, sd, ifname, (struct sockaddr *)&addr, (struct sockaddr *)&mask, NULL))
+			err(1, "Failed registering interface");
+	}
+
+	if (v6) {
+		memset(&addr, 0, sizeof(addr));
+		sin6->sin6_family = AF_INET6;
+		inet_pton(AF_INET6, "fe80::1", &sin6->sin6_addr);
+		snprintf(ifname, sizeof(ifname), "eth%d", num++);
+		if (register_socket(-1, sd, ifname, (struct sockaddr *)&addr, NULL, NULL))
+			err(1, "Failed registering interface");
+	}
+
+	/* 172.16.0.0/12, unlikely to be in a capture from a home LAN, never replied from */
+	for (i = 0; i < (size_t)fillers; i++) {
+		memset(&addr, 0, sizeof(addr));
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = htonl(0xac100001 | ((i & 0xfff) << 8));
+		snprintf(ifname, sizeof(ifname), "dummy%u", (unsigned)(i & 0xffff));
+		if (register_socket(-1, -1, ifname, (struct sockaddr *)&addr, (struct sockaddr *)&mask, NULL))
+			err(1, "Failed registering interface");
+	}
+}
+
+static void dump(const char *buf, size_t len, const struct sockaddr *sa)
+{
+	char addr[INET6_ADDRSTRLEN] = "";
+	const char *ptr, *end;
+	int port = 0;
+
+	if (sa->sa_family == AF_INET) {
+		struct sockaddr_in *sin = (struct sockaddr_in *)sa;
+
+		inet_ntop(AF_INET, &sin->sin_addr, addr, sizeof(addr));
+		port = ntohs(sin->sin_port);
+	} else if (sa->sa_family == AF_INET6) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)sa;
+
+		inet_ntop(AF_INET6, &sin6->sin6_addr, addr, sizeof(addr));
+		port = ntohs(sin6->sin6_port);
+	}
+	fprintf(out, "=> %s port %d\n", addr, port);
+
+	for (ptr = buf; ptr < buf + len; ptr = end + 2) {
+		end = strstr(ptr, "\r\n");
+		if (!end)
+			end = buf + len;
+		if (!strncasecmp(ptr, "Date:", 5))
+			fputs("Date: -", out);
+		else
+			fwrite(ptr, 1, end - ptr, out);
+		fputc('\n', out);
+	}
+}
+
+/* Replies are sent as several segments, gather them for dump() */
+static ssize_t capture(int sd, const struct msghdr *msg, int flags)
+{
+	char buf[SEND_PKT_SIZE + 1];
+	size_t i, len = 0;
+
+	(void)sd;
+	(void)flags;
+
+	for (i = 0; i < msg->msg_iovlen; i++) {
+		size_t n = msg->msg_iov[i].iov_len;
+
+		if (len + n < sizeof(buf))
+			memcpy(&buf[len], msg->msg_iov[i].iov_base, n);
+		len += n;
+	}
+	if (len >= sizeof(buf))
+		errx(1, "Reply of %zu bytes exceeds %zu", len, SEND_PKT_SIZE);
+	buf[len] = 0;
+
+	replies++;
+	reply_bytes += len;
+	if (out)
+		dump(buf, len, msg->msg_name);
+
+	return len;
+}
+
+/* ssdp:all is answered in one batch, capture each reply in turn */
+static int capture_batch(int sd, struct mmsghdr *vec, unsigned int num, int flags)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; i++)
+		vec[i].msg_len = capture(sd, &vec[i].msg_hdr, flags);
+
+	return num;
+}
+
+static void report(double secs, int loops)
+{
+	struct ifstats sum;
+	struct ifsock *ifs;
+	uint64_t num = pkts_num * loops;
+
+	memset(&sum, 0, sizeof(sum));
+	IFS_FOREACH(ifs) {
+		sum.rx_pkts     += ifs->stats.rx_pkts;
+		sum.msearch     += ifs->stats.msearch;
+		sum.unsupported += ifs->stats.unsupported;
+		sum.replies     += ifs->stats.replies;
+		sum.send_err    += ifs->stats.send_err;
+	}
+
+	printf("Packets     %10llu in %.3f sec, %.0f pkts/sec, %.1f ns/pkt\n",
+	       (unsigned long long)num, secs, num / secs, secs * 1e9 / (num ? num : 1));
+	printf("Matched     %10llu, no interface %llu\n",
+	       (unsigned long long)sum.rx_pkts, (unsigned long long)stats.no_iface);
+	printf("M-SEARCH    %10llu, unsupported ST %llu\n",
+	       (unsigned long long)sum.msearch, (unsigned long long)sum.unsupported);
+	printf("Replies     %10llu, %llu bytes\n",
+	       (unsigned long long)replies, (unsigned long long)reply_bytes);
+	printf("Neighbors   %10zu\n", cache_count());
+}
+
+static int usage(int code)
+{
+	printf("Usage: replay [-hn] [-f NUM] [-l LOOPS] [-o FILE] FILE.pcap\n"
+	       "\n"
+	       "    -f NUM    Add NUM non-matching interfaces, searched first\n"
+	       "    -h        This help text\n"
+	       "    -l LOOPS  Replay capture LOOPS times, default 1\n"
+	       "    -n        Enable neighbor registry, replays replies from port 1900 too\n"
+	       "    -o FILE   Write replies, from first loop, to FILE, '-' for stdout\n");
+
+	return code;
+}
+
+int main(int argc, char *argv[])
+{
+	struct timespec start, end, rx;
+	char buf[MAX_PKT_SIZE];
+	int c, fillers = 0, loops = 1, neighbors = 0;
+	char *file = NULL;
+	size_t i;
+	int l;
+
+	while ((c = getopt(argc, argv, "f:hl:no:")) != EOF) {
+		switch (c) {
+		case 'f':
+			fillers = atoi(optarg);
+			break;
+
+		case 'h':
+			return usage(0);
+
+		case 'l':
+			loops = atoi(optarg);
+			if (loops <= 0)
+				return usage(1);
+			break;
+
+		case 'n':
+			neighbors = 1;
+			break;
+
+		case 'o':
+			if (!strcmp(optarg, "-"))
+				out = stdout;
+			else
+				out = fopen(optarg, "w");
+			if (!out)
+				err(1, "Failed opening %s", optarg);
+			break;
+
+		default:
+			return usage(1);
+		}
+	}
+
+	if (optind >= argc)
+		return usage(1);
+	file = argv[optind];
+
+	strcpy(uuid, "uuid:00000000-0000-0000-0000-000000000000");
+	ssdp_sendmsg = capture;
+	ssdp_sendmmsg = capture_batch;
+	if (neighbors && cache_init(CACHE_MAX_NEIGHBORS))
+		return 1;
+
+	load(file, neighbors);
+	if (!pkts_num)
+		errx(1, "No SSDP packets found in %s", file);
+	table(fillers);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (l = 0; l < loops; l++) {
+		for (i = 0; i < pkts_num; i++) {
+			/* ssdp_parse() modifies the buffer */
+			memcpy(buf, pkts[i].data, pkts[i].len + 1);
+			rx = start;
+			ssdp_input(buf, pkts[i].len, (struct sockaddr *)&pkts[i].from, 0, &rx);
+		}
+
+		if (out && out != stdout)
+			fclose(out);
+		out = NULL;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	report((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, loops);
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
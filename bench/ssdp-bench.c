@@ -0,0 +1,489 @@
+/* M-SEARCH load generator and reply latency measurement for ssdpd
+ *
+ * Copyright (c) 2017  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.a
+ */
+
+/*
+ * Each source is a UDP socket with at most one query in flight, so the
+ * first reply arriving on it is matched to that query.  Any further
+ * replies, e.g. the fan-out for ssdp:all, are counted as extra.  Queries
+ * not answered within the timeout are lost, replies after that are late.
+ */
+
+#include <config.h>
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "ssdp.h"
+
+#define MAX_ST               16
+
+struct st {
+	char    *name;
+	int      weight;
+
+	uint64_t sent;
+	uint64_t replies;
+};
+
+struct source {
+	int      sd;
+	int      busy;
+	int      expired;		/* Last query timed out */
+	int      st;
+	uint64_t sent;			/* nsec, CLOCK_MONOTONIC */
+};
+
+struct sample {
+	uint32_t usec;
+	uint8_t  st;
+};
+
+static struct st st[MAX_ST];
+static int       st_num;
+static int       st_total;
+
+static struct sample *samples;
+static size_t         samples_num;
+static size_t         samples_max;
+
+static uint64_t sent, lost, late, extra, stalled;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void record(int idx, uint64_t nsec)
+{
+	if (samples_num == samples_max) {
+		struct sample *tmp;
+
+		samples_max = samples_max ? samples_max * 2 : 4096;
+		tmp = realloc(samples, samples_max * sizeof(*samples));
+		if (!tmp)
+			err(1, "Failed allocating latency samples");
+		samples = tmp;
+	}
+
+	samples[samples_num].usec = nsec / 1000;
+	samples[samples_num].st = idx;
+	samples_num++;
+}
+
+static int cmp(const void *a, const void *b)
+{
+	const struct sample *x = a, *y = b;
+
+	return (x->usec > y->usec) - (x->usec < y->usec);
+}
+
+/* Pick an ST according to weight */
+static int pick(void)
+{
+	int i, r;
+
+	r = rand() % st_total;
+	for (i = 0; i < st_num; i++) {
+		r -= st[i].weight;
+		if (r < 0)
+			return i;
+	}
+
+	return 0;
+}
+
+static int add_st(char *arg)
+{
+	char *ptr;
+
+	if (st_num >= MAX_ST)
+		return -1;
+
+	ptr = strrchr(arg, '=');
+	st[st_num].weight = 1;
+	if (ptr) {
+		*ptr++ = 0;
+		st[st_num].weight = atoi(ptr);
+		if (st[st_num].weight <= 0)
+			return -1;
+	}
+	st[st_num].name = arg;
+	st_total += st[st_num].weight;
+	st_num++;
+
+	return 0;
+}
+
+static int source(struct sockaddr_storage *dst, char *src, char *ifname)
+{
+	struct sockaddr_storage ss;
+	socklen_t len;
+	int sd, ifindex = 0;
+
+	if (ifname) {
+		ifindex = if_nametoindex(ifname);
+		if (!ifindex)
+			errx(1, "No such interface %s", ifname);
+	}
+
+	sd = socket(dst->ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sd < 0)
+		err(1, "Failed creating socket");
+
+	memset(&ss, 0, sizeof(ss));
+	ss.ss_family = dst->ss_family;
+	if (dst->ss_family == AF_INET) {
+		struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+		struct ip_mreqn mreq;
+
+		len = sizeof(*sin);
+		if (src && inet_pton(AF_INET, src, &sin->sin_addr) != 1)
+			errx(1, "Invalid source address %s", src);
+
+		memset(&mreq, 0, sizeof(mreq));
+		mreq.imr_address = sin->sin_addr;
+		mreq.imr_ifindex = ifindex;
+		if ((src || ifindex) && setsockopt(sd, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq)))
+			err(1, "Failed setting multicast interface");
+	} else {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+
+		len = sizeof(*sin6);
+		if (src && inet_pton(AF_INET6, src, &sin6->sin6_addr) != 1)
+			errx(1, "Invalid source address %s", src);
+		sin6->sin6_scope_id = ifindex;
+
+		if (ifindex && setsockopt(sd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &ifindex, sizeof(ifindex)))
+			err(1, "Failed setting multicast interface");
+	}
+
+	if (bind(sd, (struct sockaddr *)&ss, len))
+		err(1, "Failed binding source socket");
+
+	return sd;
+}
+
+static void query(struct source *s, struct sockaddr_storage *dst, int mx)
+{
+	char buf[MAX_PKT_SIZE];
+	socklen_t len;
+	int idx, n;
+
+	idx = pick();
+	n = snprintf(buf, sizeof(buf), "M-SEARCH * HTTP/1.1\r\n"
+		     "Host: %s:%d\r\n"
+		     "MAN: \"ssdp:discover\"\r\n"
+		     "MX: %d\r\n"
+		     "ST: %s\r\n"
+		     "User-Agent: ssdp-bench/" PACKAGE_VERSION "\r\n"
+		     "\r\n",
+		     dst->ss_family == AF_INET ? MC_SSDP_GROUP : "[" MC_SSDP_GROUP_IPV6 "]",
+		     MC_SSDP_PORT, mx, st[idx].name);
+
+	len = dst->ss_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+	s->sent = now_ns();
+	if (sendto(s->sd, buf, n, 0, (struct sockaddr *)dst, len) < 0) {
+		warn("Failed sending M-SEARCH");
+		return;
+	}
+
+	s->busy = 1;
+	s->expired = 0;
+	s->st = idx;
+	st[idx].sent++;
+	sent++;
+}
+
+static void reply(struct source *s)
+{
+	char buf[1500];
+	uint64_t now;
+	ssize_t len;
+
+	while ((len = recv(s->sd, buf, sizeof(buf), 0)) >= 0) {
+		now = now_ns();
+		if (!s->busy) {
+			if (s->expired) {
+				s->expired = 0;
+				late++;
+			} else {
+				extra++;
+			}
+			continue;
+		}
+
+		record(s->st, now - s->sent);
+		st[s->st].replies++;
+		s->busy = 0;
+	}
+}
+
+static uint32_t pct(size_t num, double p)
+{
+	size_t i;
+
+	if (!num)
+		return 0;
+
+	i = (size_t)(p * num);
+	if (i >= num)
+		i = num - 1;
+
+	return samples[i].usec;
+}
+
+static void report(double secs)
+{
+	uint64_t replies = samples_num;
+	int i;
+
+	qsort(samples, samples_num, sizeof(*samples), cmp);
+
+	printf("Sent       %10llu queries in %.2f sec, %.1f queries/sec\n",
+	       (unsigned long long)sent, secs, sent / secs);
+	printf("Replies    %10llu, %.1f replies/sec\n", (unsigned long long)replies, replies / secs);
+	printf("Lost       %10llu, %.3f%%\n", (unsigned long long)lost,
+	       sent ? 100.0 * lost / sent : 0.0);
+	printf("Late       %10llu\n", (unsigned long long)late);
+	printf("Extra      %10llu\n", (unsigned long long)extra);
+	printf("Stalled    %10llu, no free source when a query was due\n", (unsigned long long)stalled);
+	printf("Latency    min %u, p50 %u, p99 %u, p999 %u, max %u usec\n",
+	       pct(samples_num, 0), pct(samples_num, 0.5), pct(samples_num, 0.99),
+	       pct(samples_num, 0.999), samples_num ? samples[samples_num - 1].usec : 0);
+
+	if (st_num < 2)
+		return;
+
+	printf("\n%-48s %10s %10s %8s %8s %8s\n", "ST", "SENT", "REPLIES", "p50", "p99", "p999");
+	for (i = 0; i < st_num; i++) {
+		struct sample *all = samples;
+		size_t j, n = 0;
+
+		/* Samples are sorted, filter out this ST while keeping order */
+		samples = malloc((samples_num + 1) * sizeof(*samples));
+		if (!samples)
+			err(1, "Failed allocating");
+		for (j = 0; j < samples_num; j++) {
+			if (all[j].st == i)
+				samples[n++] = all[j];
+		}
+
+		printf("%-48s %10llu %10llu %8u %8u %8u\n", st[i].name,
+		       (unsigned long long)st[i].sent, (unsigned long long)st[i].replies,
+		       pct(n, 0.5), pct(n, 0.99), pct(n, 0.999));
+		free(samples);
+		samples = all;
+	}
+}
+
+static int usage(int code)
+{
+	printf("Usage: ssdp-bench [-h] [-a ADDR] [-c NUM] [-d SEC] [-i IFACE] [-m MX]\n"
+	       "                  [-r RATE] [-s ST[=WEIGHT]] [-S ADDR] [-t MSEC]\n"
+	       "\n"
+	       "    -a ADDR   Send to ADDR, unicast or multicast, default %s\n"
+	       "    -c NUM    Number of sources, i.e., max queries in flight, default 16\n"
+	       "    -d SEC    Duration of test, default 10 sec\n"
+	       "    -h        This help text\n"
+	       "    -i IFACE  Send multicast on IFACE\n"
+	       "    -m MX     MX header in queries, default 1\n"
+	       "    -r RATE   Queries per second, 0 for as fast as replies allow, default 100\n"
+	       "    -s ST     Search type, repeat for a mix, optional relative WEIGHT,\n"
+	       "              default " SSDP_ST_ALL "\n"
+	       "    -S ADDR   Source address to bind to\n"
+	       "    -t MSEC   Reply timeout, default 1000 msec\n"
+	       "\n"
+	       "Example:\n"
+	       "    ssdp-bench -i eth0 -r 5000 -s upnp:rootdevice=9 -s ssdp:all=1\n",
+	       MC_SSDP_GROUP);
+
+	return code;
+}
+
+int main(int argc, char *argv[])
+{
+	char *addr = MC_SSDP_GROUP, *src = NULL, *ifname = NULL;
+	int c, i, num = 16, duration = 10, mx = 1, rate = 100, timeout = 1000;
+	uint64_t start, end, next, interval = 0, now;
+	struct sockaddr_storage dst;
+	struct source *sources;
+	struct pollfd *pfd;
+
+	while ((c = getopt(argc, argv, "a:c:d:hi:m:r:s:S:t:")) != EOF) {
+		switch (c) {
+		case 'a':
+			addr = optarg;
+			break;
+
+		case 'c':
+			num = atoi(optarg);
+			break;
+
+		case 'd':
+			duration = atoi(optarg);
+			break;
+
+		case 'h':
+			return usage(0);
+
+		case 'i':
+			ifname = optarg;
+			break;
+
+		case 'm':
+			mx = atoi(optarg);
+			break;
+
+		case 'r':
+			rate = atoi(optarg);
+			break;
+
+		case 's':
+			if (add_st(optarg))
+				errx(1, "Invalid or too many search types, max %d", MAX_ST);
+			break;
+
+		case 'S':
+			src = optarg;
+			break;
+
+		case 't':
+			timeout = atoi(optarg);
+			break;
+
+		default:
+			return usage(1);
+		}
+	}
+
+	if (num <= 0 || duration <= 0 || rate < 0 || timeout <= 0)
+		return usage(1);
+	if (!st_num)
+		add_st(SSDP_ST_ALL);
+
+	memset(&dst, 0, sizeof(dst));
+	if (inet_pton(AF_INET, addr, &((struct sockaddr_in *)&dst)->sin_addr) == 1) {
+		dst.ss_family = AF_INET;
+		((struct sockaddr_in *)&dst)->sin_port = htons(MC_SSDP_PORT);
+	} else if (inet_pton(AF_INET6, addr, &((struct sockaddr_in6 *)&dst)->sin6_addr) == 1) {
+		dst.ss_family = AF_INET6;
+		((struct sockaddr_in6 *)&dst)->sin6_port = htons(MC_SSDP_PORT);
+		if (ifname)
+			((struct sockaddr_in6 *)&dst)->sin6_scope_id = if_nametoindex(ifname);
+	} else {
+		errx(1, "Invalid address %s", addr);
+	}
+
+	sources = calloc(num, sizeof(*sources));
+	pfd = calloc(num, sizeof(*pfd));
+	if (!sources || !pfd)
+		err(1, "Failed allocating sources");
+
+	for (i = 0; i < num; i++) {
+		sources[i].sd = source(&dst, src, ifname);
+		pfd[i].fd = sources[i].sd;
+		pfd[i].events = POLLIN;
+	}
+
+	srand(time(NULL));
+	if (rate)
+		interval = 1000000000 / rate;
+
+	start = next = now_ns();
+	end = start + (uint64_t)duration * 1000000000;
+	while (1) {
+		int busy = 0, wait;
+
+		now = now_ns();
+
+		/* Expire queries without reply */
+		for (i = 0; i < num; i++) {
+			if (!sources[i].busy)
+				continue;
+			if (now - sources[i].sent > (uint64_t)timeout * 1000000) {
+				sources[i].busy = 0;
+				sources[i].expired = 1;
+				lost++;
+				continue;
+			}
+			busy++;
+		}
+
+		if (now >= end) {
+			if (!busy)
+				break;
+		} else if (!rate) {
+			for (i = 0; i < num; i++) {
+				if (!sources[i].busy)
+					query(&sources[i], &dst, mx);
+			}
+		} else {
+			while (next <= now) {
+				for (i = 0; i < num; i++) {
+					if (!sources[i].busy)
+						break;
+				}
+				if (i == num)
+					stalled++;
+				else
+					query(&sources[i], &dst, mx);
+				next += interval;
+			}
+		}
+
+		if (now >= end || !rate)
+			wait = 1;
+		else
+			wait = (next - now) / 1000000;
+
+		if (poll(pfd, num, wait) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "Failed polling sources");
+		}
+
+		for (i = 0; i < num; i++) {
+			if (pfd[i].revents & POLLIN)
+				reply(&sources[i]);
+		}
+	}
+
+	report((now_ns() - start) / 1e9);
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,294 @@
+/* Registry of SSDP neighbors, learned from NOTIFY and M-SEARCH replies
+ *
+ * Copyright (c) 2017  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.a
+ */
+
+#include <config.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "ssdp.h"
+#include "queue.h"
+
+/* Must be a power of two, expiry is handled by one timer per neighbor */
+#define CACHE_BUCKETS        512
+
+static LIST_HEAD(, neighbor) buckets[CACHE_BUCKETS];
+static TAILQ_HEAD(, neighbor) lru = TAILQ_HEAD_INITIALIZER(lru);
+static LIST_HEAD(, neighbor) pool = LIST_HEAD_INITIALIZER();
+
+static struct neighbor *entries;
+static size_t max_entries;
+static size_t num_entries;
+
+/* FNV-1a, good enough spread for the USN strings we see on a LAN */
+static unsigned int hash(const char *str)
+{
+	unsigned int h = 2166136261u;
+
+	while (*str) {
+		h ^= (unsigned char)*str++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/*
+ * Find header in SSDP message, copy its value without leading space.
+ * Returns NULL if the header is missing, e.g., "\r\nUSN:"
+ */
+static char *header(char *buf, const char *name, char *val, size_t len)
+{
+	char *ptr, *end;
+	size_t n;
+
+	ptr = strcasestr(buf, name);
+	if (!ptr)
+		return NULL;
+
+	ptr += strlen(name);
+	while (*ptr == ' ' || *ptr == '\t')
+		ptr++;
+
+	end = strstr(ptr, "\r\n");
+	if (!end)
+		return NULL;
+
+	n = end - ptr;
+	if (n >= len)
+		n = len - 1;
+	memcpy(val, ptr, n);
+	val[n] = 0;
+
+	return val;
+}
+
+static int max_age(char *buf)
+{
+	char val[64], *ptr;
+	int age;
+
+	if (!header(buf, "\r\nCACHE-CONTROL:", val, sizeof(val)))
+		return CACHE_TIMEOUT;
+
+	ptr = strcasestr(val, "max-age");
+	if (!ptr)
+		return CACHE_TIMEOUT;
+
+	ptr += 7;
+	while (*ptr == ' ' || *ptr == '=')
+		ptr++;
+
+	age = atoi(ptr);
+	if (age <= 0)
+		return CACHE_TIMEOUT;
+
+	return age;
+}
+
+static struct neighbor *lookup(const char *usn, unsigned int h)
+{
+	struct neighbor *n;
+
+	LIST_FOREACH(n, &buckets[h & (CACHE_BUCKETS - 1)], hlink) {
+		if (n->hash == h && !strcmp(n->usn, usn))
+			return n;
+	}
+
+	return NULL;
+}
+
+static void release(struct neighbor *n)
+{
+	LIST_REMOVE(n, hlink);
+	timer_stop(&n->expiry);
+	TAILQ_REMOVE(&lru, n, lru);
+	LIST_INSERT_HEAD(&pool, n, hlink);
+	num_entries--;
+}
+
+static void expire(void *arg, uint64_t now)
+{
+	struct neighbor *n = arg;
+
+	(void)now;
+	logit(LOG_DEBUG, "Neighbor %s expired", n->usn);
+	release(n);
+}
+
+/* Insert new, or refresh existing, neighbor.  Evicts the stalest when full. */
+static void update(char *usn, char *nt, char *buf, struct sockaddr *sa, char *ifname)
+{
+	struct neighbor *n;
+	unsigned int h;
+
+	/* Skip our own announcements */
+	if (!strncmp(usn, uuid, strlen(uuid)))
+		return;
+
+	h = hash(usn);
+	n = lookup(usn, h);
+	if (n) {
+		TAILQ_REMOVE(&lru, n, lru);
+	} else {
+		n = LIST_FIRST(&pool);
+		if (!n) {
+			n = TAILQ_FIRST(&lru);
+			logit(LOG_DEBUG, "Neighbor cache full, evicting %s", n->usn);
+			release(n);
+			n = LIST_FIRST(&pool);
+		}
+		LIST_REMOVE(n, hlink);
+
+		memset(n, 0, sizeof(*n));
+		n->hash = h;
+		strncpy(n->usn, usn, sizeof(n->usn) - 1);
+		LIST_INSERT_HEAD(&buckets[h & (CACHE_BUCKETS - 1)], n, hlink);
+		num_entries++;
+
+		logit(LOG_DEBUG, "New neighbor %s", usn);
+	}
+
+	strncpy(n->nt, nt, sizeof(n->nt) - 1);
+	if (!header(buf, "\r\nLOCATION:", n->location, sizeof(n->location)))
+		n->location[0] = 0;
+	if (!header(buf, "\r\nSERVER:", n->server, sizeof(n->server)))
+		n->server[0] = 0;
+	if (ifname)
+		strncpy(n->ifname, ifname, sizeof(n->ifname) - 1);
+	memcpy(&n->from, sa, sa->sa_family == AF_INET6
+	       ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+
+	timer_start(&n->expiry, timer_now() + (uint64_t)max_age(buf) * 1000, expire, n);
+	TAILQ_INSERT_TAIL(&lru, n, lru);
+}
+
+static void remove_usn(char *usn)
+{
+	struct neighbor *n;
+
+	n = lookup(usn, hash(usn));
+	if (!n)
+		return;
+
+	logit(LOG_DEBUG, "Neighbor %s leaving", usn);
+	release(n);
+}
+
+/* NOTIFY * with NTS: ssdp:alive or ssdp:byebye */
+void cache_notify(char *buf, struct sockaddr *sa, char *ifname)
+{
+	char usn[NEIGH_USN_LEN], nt[NEIGH_NT_LEN], nts[32];
+
+	if (!entries)
+		return;
+
+	if (!header(buf, "\r\nUSN:", usn, sizeof(usn)) ||
+	    !header(buf, "\r\nNTS:", nts, sizeof(nts)))
+		return;
+
+	if (!strcasecmp(nts, "ssdp:byebye")) {
+		remove_usn(usn);
+		return;
+	}
+
+	if (strcasecmp(nts, "ssdp:alive"))
+		return;
+
+	if (!header(buf, "\r\nNT:", nt, sizeof(nt)))
+		return;
+
+	update(usn, nt, buf, sa, ifname);
+}
+
+/* HTTP/1.1 200 OK reply to one of our M-SEARCH * */
+void cache_response(char *buf, struct sockaddr *sa, char *ifname)
+{
+	char usn[NEIGH_USN_LEN], st[NEIGH_NT_LEN];
+
+	if (!entries)
+		return;
+
+	if (!header(buf, "\r\nUSN:", usn, sizeof(usn)) ||
+	    !header(buf, "\r\nST:", st, sizeof(st)))
+		return;
+
+	update(usn, st, buf, sa, ifname);
+}
+
+size_t cache_count(void)
+{
+	return num_entries;
+}
+
+size_t cache_size(void)
+{
+	return max_entries;
+}
+
+/* Iterate neighbors, least recently refreshed first */
+struct neighbor *cache_first(void)
+{
+	return TAILQ_FIRST(&lru);
+}
+
+struct neighbor *cache_next(struct neighbor *n)
+{
+	return TAILQ_NEXT(n, lru);
+}
+
+int cache_init(size_t max)
+{
+	size_t i;
+
+	if (!max)
+		return 0;
+
+	entries = calloc(max, sizeof(*entries));
+	if (!entries) {
+		logit(LOG_ERR, "Failed allocating neighbor cache: %s", strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < max; i++)
+		LIST_INSERT_HEAD(&pool, &entries[i], hlink);
+	max_entries = max;
+
+	return 0;
+}
+
+void cache_exit(void)
+{
+	struct neighbor *n;
+
+	TAILQ_FOREACH(n, &lru, lru)
+		timer_stop(&n->expiry);
+	free(entries);
+	entries = NULL;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
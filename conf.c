@@ -0,0 +1,219 @@
+/* Configuration file, read at startup and on SIGHUP
+ *
+ * Copyright (c) 2017  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.a
+ */
+
+#include <config.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ssdp.h"
+
+/*
+ * One setting per line, key = value, # starts a comment.  Keys:
+ *
+ *   interfaces       = eth0 eth1	# Default all, or as given on command line
+ *   interval         = 300		# NOTIFY interval, sec
+ *   refresh          = 600		# Interface refresh, sec
+ *   pps              = 100		# NOTIFY packets/sec, 0 no limit
+ *   buffer-max       = 1024		# Socket buffer limit, KiB
+ *   upstream         = eth0		# Proxy mode, answer for devices here
+ *   device-type      = urn:schemas-upnp-org:device:InternetGatewayDevice:1
+ *   friendly-name    = Living room	# Default hostname
+ *   manufacturer     = ...
+ *   manufacturer-url = ...
+ *   model            = ...
+ */
+
+static char *trim(char *str)
+{
+	char *end;
+
+	while (isspace((unsigned char)*str))
+		str++;
+
+	end = str + strlen(str);
+	while (end > str && isspace((unsigned char)end[-1]))
+		*--end = 0;
+
+	return str;
+}
+
+static int number(char *file, int lineno, char *val, int min, int max, int *out)
+{
+	char *end;
+	long num;
+
+	errno = 0;
+	num = strtol(val, &end, 10);
+	if (errno || *end || end == val || num < min || num > max) {
+		logit(LOG_ERR, "%s:%d: invalid value %s, must be %d-%d", file, lineno, val, min, max);
+		return -1;
+	}
+	*out = num;
+
+	return 0;
+}
+
+static int string(char *file, int lineno, char *val, char *out, size_t len)
+{
+	if (strlen(val) >= len) {
+		logit(LOG_ERR, "%s:%d: value too long, max %zu", file, lineno, len - 1);
+		return -1;
+	}
+	strcpy(out, val);
+
+	return 0;
+}
+
+static int ifaces(struct conf *conf, char *val)
+{
+	char *tok, *ptr;
+
+	conf_free(conf);
+	conf->ifalloc = 1;
+	for (tok = strtok_r(val, " \t,", &ptr); tok; tok = strtok_r(NULL, " \t,", &ptr)) {
+		char **tmp;
+
+		tmp = realloc(conf->ifaces, (conf->ifnum + 1) * sizeof(char *));
+		if (!tmp)
+			return -1;
+		conf->ifaces = tmp;
+
+		conf->ifaces[conf->ifnum] = strdup(tok);
+		if (!conf->ifaces[conf->ifnum])
+			return -1;
+		conf->ifnum++;
+	}
+
+	return 0;
+}
+
+/* Replaces the list, if any, from the command line */
+static int upstreams(char *file, int lineno, struct conf *conf, char *val)
+{
+	char *tok, *ptr;
+
+	conf->upnum = 0;
+	for (tok = strtok_r(val, " \t,", &ptr); tok; tok = strtok_r(NULL, " \t,", &ptr)) {
+		if (conf->upnum == UPSTREAM_MAX) {
+			logit(LOG_ERR, "%s:%d: too many upstream interfaces, max %d", file, lineno, UPSTREAM_MAX);
+			return -1;
+		}
+		if (string(file, lineno, tok, conf->upstream[conf->upnum], sizeof(conf->upstream[0])))
+			return -1;
+		conf->upnum++;
+	}
+
+	return 0;
+}
+
+/*
+ * Read file on top of conf, which holds the command line settings.  On
+ * error conf may be partially updated, and must not be used.
+ */
+int conf_read(char *file, struct conf *conf)
+{
+	char line[256];
+	int lineno = 0, rc = 0;
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (!fp) {
+		logit(LOG_ERR, "Failed opening %s: %s", file, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		char *key, *val, *ptr;
+
+		lineno++;
+		ptr = strchr(line, '#');
+		if (ptr)
+			*ptr = 0;
+
+		key = trim(line);
+		if (!*key)
+			continue;
+
+		ptr = strchr(key, '=');
+		if (!ptr) {
+			logit(LOG_ERR, "%s:%d: missing '='", file, lineno);
+			rc = -1;
+			break;
+		}
+		*ptr++ = 0;
+		key = trim(key);
+		val = trim(ptr);
+
+		if (!strcmp(key, "interfaces"))
+			rc = ifaces(conf, val);
+		else if (!strcmp(key, "interval"))
+			rc = number(file, lineno, val, 30, 900, &conf->interval);
+		else if (!strcmp(key, "refresh"))
+			rc = number(file, lineno, val, 5, 1800, &conf->refresh);
+		else if (!strcmp(key, "pps"))
+			rc = number(file, lineno, val, 0, NOTIFY_PPS_MAX, &conf->pps);
+		else if (!strcmp(key, "buffer-max"))
+			rc = number(file, lineno, val, 0, 65536, &conf->bufmax);
+		else if (!strcmp(key, "upstream"))
+			rc = upstreams(file, lineno, conf, val);
+		else if (!strcmp(key, "device-type"))
+			rc = string(file, lineno, val, conf->device_type, sizeof(conf->device_type));
+		else if (!strcmp(key, "friendly-name"))
+			rc = string(file, lineno, val, conf->friendly_name, sizeof(conf->friendly_name));
+		else if (!strcmp(key, "manufacturer"))
+			rc = string(file, lineno, val, conf->manufacturer, sizeof(conf->manufacturer));
+		else if (!strcmp(key, "manufacturer-url"))
+			rc = string(file, lineno, val, conf->manufacturer_url, sizeof(conf->manufacturer_url));
+		else if (!strcmp(key, "model"))
+			rc = string(file, lineno, val, conf->model, sizeof(conf->model));
+		else {
+			logit(LOG_ERR, "%s:%d: unknown setting %s", file, lineno, key);
+			rc = -1;
+		}
+
+		if (rc)
+			break;
+	}
+	fclose(fp);
+
+	return rc;
+}
+
+/* Free the interface list, if it was read from file */
+void conf_free(struct conf *conf)
+{
+	size_t i;
+
+	if (conf->ifalloc) {
+		for (i = 0; i < conf->ifnum; i++)
+			free(conf->ifaces[i]);
+		free(conf->ifaces);
+	}
+	conf->ifaces  = NULL;
+	conf->ifnum   = 0;
+	conf->ifalloc = 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
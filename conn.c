@@ -0,0 +1,207 @@
+/* Stream clients, served from the main loop without blocking it
+ *
+ * Copyright (c) 2017  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.a
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "ssdp.h"
+
+/*
+ * Clients of the control socket and the web server.  The request is
+ * read, and the reply written, as the socket allows, from the poll set
+ * of the main loop.  Each client has one deadline for the whole
+ * exchange, a client that is too slow is dropped, so SSDP processing is
+ * never held up by it.
+ */
+static LIST_HEAD(, conn) conns = LIST_HEAD_INITIALIZER();
+static size_t   num_conns;
+static unsigned gen;
+
+static void expire(void *arg, uint64_t now)
+{
+	struct conn *c = arg;
+
+	(void)now;
+	logit(LOG_DEBUG, "Dropping slow client, socket %d", c->sd);
+	conn_close(c);
+}
+
+/* Take over accepted client sd, input(c) is called as its request grows */
+int conn_add(int sd, int (*input)(struct conn *), void *arg)
+{
+	struct conn *c;
+
+	if (num_conns >= CONN_MAX) {
+		logit(LOG_WARNING, "Too many clients, max %d, dropping new one.", CONN_MAX);
+		goto fail;
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		logit(LOG_WARNING, "Failed allocating client: %s", strerror(errno));
+		goto fail;
+	}
+
+	fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK);
+	c->sd    = sd;
+	c->input = input;
+	c->arg   = arg;
+	timer_start(&c->deadline, timer_now() + CONN_TIMEOUT, expire, c);
+
+	LIST_INSERT_HEAD(&conns, c, link);
+	num_conns++;
+	gen++;
+
+	return 0;
+fail:
+	close(sd);
+	return -1;
+}
+
+/* Queue reply, a malloc'ed buf, the client is closed when it is sent */
+void conn_reply(struct conn *c, char *buf, size_t len)
+{
+	free(c->buf);
+	c->buf = buf;
+	c->len = len;
+	c->off = 0;
+	c->done = 1;
+	gen++;			/* Poll for POLLOUT instead */
+}
+
+void conn_close(struct conn *c)
+{
+	timer_stop(&c->deadline);
+	LIST_REMOVE(c, link);
+	num_conns--;
+	gen++;
+
+	shutdown(c->sd, SHUT_RDWR);
+	close(c->sd);
+	free(c->buf);
+	free(c);
+}
+
+static void writable(struct conn *c)
+{
+	ssize_t num;
+
+	while (c->off < c->len) {
+		num = send(c->sd, c->buf + c->off, c->len - c->off, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (num < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return;
+
+			logit(LOG_WARNING, "Failed sending reply to client: %s", strerror(errno));
+			break;
+		}
+		c->off += num;
+	}
+
+	conn_close(c);
+}
+
+static void readable(struct conn *c)
+{
+	ssize_t num;
+
+	num = recv(c->sd, c->req + c->req_len, sizeof(c->req) - 1 - c->req_len, 0);
+	if (num < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	if (num <= 0) {
+		conn_close(c);
+		return;
+	}
+	c->req_len += num;
+	c->req[c->req_len] = 0;
+
+	/* Incomplete, wait for more unless the buffer is full */
+	if (c->input(c) > 0 && c->req_len < sizeof(c->req) - 1)
+		return;
+
+	if (!c->done) {
+		conn_close(c);
+		return;
+	}
+
+	/* Most replies fit in the socket buffer, no need to wait for POLLOUT */
+	writable(c);
+}
+
+/* Fill in pfd for all clients, reading until there is a reply to send */
+size_t conn_poll(struct pollfd *pfd)
+{
+	struct conn *c;
+	size_t num = 0;
+
+	LIST_FOREACH(c, &conns, link) {
+		pfd[num].fd     = c->sd;
+		pfd[num].events = c->done ? POLLOUT : POLLIN;
+		num++;
+	}
+
+	return num;
+}
+
+void conn_event(int sd, short revents)
+{
+	struct conn *c;
+
+	LIST_FOREACH(c, &conns, link) {
+		if (c->sd == sd)
+			break;
+	}
+	if (!c)
+		return;
+
+	if (!c->done && (revents & (POLLIN | POLLHUP | POLLERR)))
+		readable(c);
+	else if (c->done && (revents & (POLLOUT | POLLHUP | POLLERR)))
+		writable(c);
+}
+
+size_t conn_count(void)
+{
+	return num_conns;
+}
+
+/* Changes when a client is added or removed, the poll set is then stale */
+unsigned conn_gen(void)
+{
+	return gen;
+}
+
+void conn_exit(void)
+{
+	struct conn *c;
+
+	while ((c = LIST_FIRST(&conns)))
+		conn_close(c);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
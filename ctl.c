@@ -0,0 +1,507 @@
+/* Control socket for ssdpctl, live introspection of the daemon
+ *
+ * Copyright (c) 2017  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.a
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "ssdp.h"
+
+enum {
+	SHOW_INTERFACES = 1,
+	SHOW_STATS      = 2,
+	SHOW_NEIGHBORS  = 4,
+	SHOW_LATENCY    = 8,
+	SHOW_ALL        = 15,
+};
+
+static int   ctl_sd = -1;
+static char *ctl_path;
+
+static void json_string(FILE *fp, const char *str)
+{
+	fputc('"', fp);
+	for (; *str; str++) {
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\')
+			fprintf(fp, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(fp, "\\u%04x", c);
+		else
+			fputc(c, fp);
+	}
+	fputc('"', fp);
+}
+
+static char *ifaddr(struct sockaddr_storage *ss, char *buf, size_t len)
+{
+	if (ss->ss_family == AF_INET)
+		inet_ntop(AF_INET, &((struct sockaddr_in *)ss)->sin_addr, buf, len);
+	else if (ss->ss_family == AF_INET6)
+		inet_ntop(AF_INET6, &((struct sockaddr_in6 *)ss)->sin6_addr, buf, len);
+	else
+		strncpy(buf, "-", len);
+
+	return buf;
+}
+
+static uint64_t lat_avg(struct ifstats *st)
+{
+	if (!st->lat_num)
+		return 0;
+
+	return st->lat_sum / st->lat_num;
+}
+
+/* Percentiles reported, in permille */
+static const int pcts[] = { 500, 900, 990, 999 };
+
+static void lat_text(FILE *fp, struct hist *h)
+{
+	size_t i;
+
+	fprintf(fp, " %8llu", (unsigned long long)h->num);
+	for (i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++)
+		fprintf(fp, " %10llu", (unsigned long long)hist_pct(h, pcts[i]));
+	fputc('\n', fp);
+}
+
+/* Percentiles, and the non-empty buckets as [lowest usec, count] */
+static void lat_json(FILE *fp, struct hist *h)
+{
+	const char *sep = "";
+	size_t i;
+
+	fprintf(fp, ", \"replies\": %llu, \"sum_usec\": %llu",
+		(unsigned long long)h->num, (unsigned long long)h->sum);
+	for (i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++)
+		fprintf(fp, ", \"p%d\": %llu", pcts[i] % 10 ? pcts[i] : pcts[i] / 10,
+			(unsigned long long)hist_pct(h, pcts[i]));
+
+	fprintf(fp, ", \"buckets\": [");
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		if (!h->count[i])
+			continue;
+		fprintf(fp, "%s[%llu, %u]", sep, (unsigned long long)hist_floor(i), h->count[i]);
+		sep = ", ";
+	}
+	fprintf(fp, "] }");
+}
+
+/* Seconds left of the neighbor's max-age, rounded up */
+static long expires(struct neighbor *n, uint64_t now)
+{
+	if (n->expiry.expires <= now)
+		return 0;
+
+	return (n->expiry.expires - now + 999) / 1000;
+}
+
+static void show_text(FILE *fp, int what)
+{
+	char addr[INET6_ADDRSTRLEN];
+	struct neighbor *n;
+	struct ifsock *ifs;
+	uint64_t now, pass, drop;
+	int i;
+
+	if (what & SHOW_INTERFACES) {
+		fprintf(fp, "%-16s %-40s %10s %12s %10s %12s\n", "INTERFACE", "ADDRESS",
+			"RX PKTS", "RX BYTES", "TX PKTS", "TX BYTES");
+		IFS_FOREACH(ifs) {
+			if (ifs->out == -1)
+				continue;
+
+			fprintf(fp, "%-16s %-40s %10llu %12llu %10llu %12llu\n", ifs->ifname,
+				ifaddr(&ifs->addr, addr, sizeof(addr)),
+				(unsigned long long)ifs->stats.rx_pkts,
+				(unsigned long long)ifs->stats.rx_bytes,
+				(unsigned long long)ifs->stats.tx_pkts,
+				(unsigned long long)ifs->stats.tx_bytes);
+		}
+		fprintf(fp, "\nInterface table %zu entries of %zu bytes, %zu bytes allocated\n",
+			ift.num, sizeof(struct ifkey) + sizeof(struct ifsock), socket_memory());
+	}
+
+	if (what & SHOW_STATS) {
+		if (what & SHOW_INTERFACES)
+			fputc('\n', fp);
+
+		fprintf(fp, "%-16s %-40s %8s %8s %8s %8s %8s %10s %10s %10s\n", "INTERFACE", "ADDRESS",
+			"M-SEARCH", "UNSUPP", "REPLIES", "NOTIFY", "ERRORS", "MIN usec", "AVG usec", "MAX usec");
+		IFS_FOREACH(ifs) {
+			if (ifs->out == -1)
+				continue;
+
+			fprintf(fp, "%-16s %-40s %8llu %8llu %8llu %8llu %8llu %10llu %10llu %10llu\n", ifs->ifname,
+				ifaddr(&ifs->addr, addr, sizeof(addr)),
+				(unsigned long long)ifs->stats.msearch,
+				(unsigned long long)ifs->stats.unsupported,
+				(unsigned long long)ifs->stats.replies,
+				(unsigned long long)ifs->stats.notify,
+				(unsigned long long)ifs->stats.send_err,
+				(unsigned long long)ifs->stats.lat_min,
+				(unsigned long long)lat_avg(&ifs->stats),
+				(unsigned long long)ifs->stats.lat_max);
+		}
+		fprintf(fp, "\nSockets %llu events handled, %llu empty reads, %llu datagrams lost\n",
+			(unsigned long long)stats.events, (unsigned long long)stats.empty_reads,
+			(unsigned long long)stats.rx_drops);
+		if (!filter_count(&pass, &drop))
+			fprintf(fp, "Filter  %llu datagrams passed, %llu dropped\n",
+				(unsigned long long)pass, (unsigned long long)drop);
+		if (upnum) {
+			fprintf(fp, "Proxy   %llu replies for neighbors on", (unsigned long long)stats.proxied);
+			for (i = 0; i < upnum; i++)
+				fprintf(fp, " %s", upstream[i]);
+			fputc('\n', fp);
+		}
+	}
+
+	if (what & SHOW_LATENCY) {
+		if (what & (SHOW_INTERFACES | SHOW_STATS))
+			fputc('\n', fp);
+
+		fprintf(fp, "%-16s %-40s %8s %10s %10s %10s %10s\n", "INTERFACE", "ADDRESS",
+			"REPLIES", "P50 usec", "P90 usec", "P99 usec", "P999 usec");
+		IFS_FOREACH(ifs) {
+			if (!ifs->lat)
+				continue;
+
+			fprintf(fp, "%-16s %-40s", ifs->ifname, ifaddr(&ifs->addr, addr, sizeof(addr)));
+			lat_text(fp, ifs->lat);
+		}
+
+		fprintf(fp, "\n%-57s %8s %10s %10s %10s %10s\n", "SEARCH TARGET",
+			"REPLIES", "P50 usec", "P90 usec", "P99 usec", "P999 usec");
+		for (i = 0; i < SSDP_TYPES; i++) {
+			fprintf(fp, "%-57s", supported_types[i]);
+			lat_text(fp, &st_lat[i]);
+		}
+	}
+
+	if (what & SHOW_NEIGHBORS) {
+		if (what & (SHOW_INTERFACES | SHOW_STATS | SHOW_LATENCY))
+			fputc('\n', fp);
+
+		now = timer_now();
+		fprintf(fp, "Neighbors %zu/%zu\n", cache_count(), cache_size());
+		fprintf(fp, "%-16s %-40s %7s  %s\n", "INTERFACE", "ADDRESS", "EXPIRES", "USN");
+		for (n = cache_first(); n; n = cache_next(n)) {
+			fprintf(fp, "%-16s %-40s %6lds  %s\n", n->ifname[0] ? n->ifname : "-",
+				ifaddr(&n->from, addr, sizeof(addr)),
+				expires(n, now), n->usn);
+			if (n->location[0])
+				fprintf(fp, "%66s%s\n", "", n->location);
+		}
+	}
+}
+
+static void show_json(FILE *fp, int what)
+{
+	char addr[INET6_ADDRSTRLEN];
+	struct neighbor *n;
+	struct ifsock *ifs;
+	const char *sep = "";
+	uint64_t now, pass, drop;
+	int i;
+
+	fprintf(fp, "{\n");
+
+	if (what & (SHOW_INTERFACES | SHOW_STATS)) {
+		fprintf(fp, "  \"interfaces\": [");
+		IFS_FOREACH(ifs) {
+			if (ifs->out == -1)
+				continue;
+
+			fprintf(fp, "%s\n    { \"name\": ", sep);
+			json_string(fp, ifs->ifname);
+			fprintf(fp, ", \"address\": \"%s\"", ifaddr(&ifs->addr, addr, sizeof(addr)));
+			if (what & SHOW_INTERFACES)
+				fprintf(fp, ", \"rx_packets\": %llu, \"rx_bytes\": %llu"
+					", \"tx_packets\": %llu, \"tx_bytes\": %llu",
+					(unsigned long long)ifs->stats.rx_pkts,
+					(unsigned long long)ifs->stats.rx_bytes,
+					(unsigned long long)ifs->stats.tx_pkts,
+					(unsigned long long)ifs->stats.tx_bytes);
+			if (what & SHOW_STATS)
+				fprintf(fp, ", \"msearch\": %llu, \"unsupported\": %llu"
+					", \"replies\": %llu, \"notify\": %llu, \"send_errors\": %llu"
+					", \"latency_usec\": { \"replies\": %llu"
+					", \"min\": %llu, \"avg\": %llu, \"max\": %llu }",
+					(unsigned long long)ifs->stats.msearch,
+					(unsigned long long)ifs->stats.unsupported,
+					(unsigned long long)ifs->stats.replies,
+					(unsigned long long)ifs->stats.notify,
+					(unsigned long long)ifs->stats.send_err,
+					(unsigned long long)ifs->stats.lat_num,
+					(unsigned long long)ifs->stats.lat_min,
+					(unsigned long long)lat_avg(&ifs->stats),
+					(unsigned long long)ifs->stats.lat_max);
+			fprintf(fp, " }");
+			sep = ",";
+		}
+		fprintf(fp, "\n  ],\n");
+		fprintf(fp, "  \"interface_table\": { \"entries\": %zu, \"entry_bytes\": %zu"
+			", \"bytes\": %zu }%s\n", ift.num, sizeof(struct ifkey) + sizeof(struct ifsock),
+			socket_memory(), (what & (SHOW_STATS | SHOW_LATENCY | SHOW_NEIGHBORS)) ? "," : "");
+		if ((what & SHOW_STATS) && !filter_count(&pass, &drop))
+			fprintf(fp, "  \"filter\": { \"passed\": %llu, \"dropped\": %llu },\n",
+				(unsigned long long)pass, (unsigned long long)drop);
+		if ((what & SHOW_STATS) && upnum) {
+			fprintf(fp, "  \"proxy\": { \"upstream\": [");
+			for (i = 0; i < upnum; i++) {
+				fprintf(fp, "%s", i ? ", " : "");
+				json_string(fp, upstream[i]);
+			}
+			fprintf(fp, "], \"replies\": %llu },\n", (unsigned long long)stats.proxied);
+		}
+		if (what & SHOW_STATS)
+			fprintf(fp, "  \"sockets\": { \"events\": %llu, \"empty_reads\": %llu"
+				", \"lost\": %llu }%s\n",
+				(unsigned long long)stats.events, (unsigned long long)stats.empty_reads,
+				(unsigned long long)stats.rx_drops,
+				(what & (SHOW_LATENCY | SHOW_NEIGHBORS)) ? "," : "");
+	}
+
+	if (what & SHOW_LATENCY) {
+		sep = "";
+		fprintf(fp, "  \"latency\": {\n    \"interfaces\": [");
+		IFS_FOREACH(ifs) {
+			if (!ifs->lat)
+				continue;
+
+			fprintf(fp, "%s\n      { \"name\": ", sep);
+			json_string(fp, ifs->ifname);
+			fprintf(fp, ", \"address\": \"%s\"", ifaddr(&ifs->addr, addr, sizeof(addr)));
+			lat_json(fp, ifs->lat);
+			sep = ",";
+		}
+		fprintf(fp, "\n    ],\n    \"search_targets\": [");
+		for (i = 0; i < SSDP_TYPES; i++) {
+			fprintf(fp, "%s\n      { \"st\": ", i ? "," : "");
+			json_string(fp, supported_types[i]);
+			lat_json(fp, &st_lat[i]);
+		}
+		fprintf(fp, "\n    ]\n  }%s\n", (what & SHOW_NEIGHBORS) ? "," : "");
+	}
+
+	if (what & SHOW_NEIGHBORS) {
+		now = timer_now();
+		sep = "";
+		fprintf(fp, "  \"neighbors\": [");
+		for (n = cache_first(); n; n = cache_next(n)) {
+			fprintf(fp, "%s\n    { \"interface\": ", sep);
+			json_string(fp, n->ifname);
+			fprintf(fp, ", \"address\": \"%s\", \"expires\": %ld, \"usn\": ",
+				ifaddr(&n->from, addr, sizeof(addr)), expires(n, now));
+			json_string(fp, n->usn);
+			fprintf(fp, ", \"nt\": ");
+			json_string(fp, n->nt);
+			fprintf(fp, ", \"location\": ");
+			json_string(fp, n->location);
+			fprintf(fp, ", \"server\": ");
+			json_string(fp, n->server);
+			fprintf(fp, " }");
+			sep = ",";
+		}
+		fprintf(fp, "\n  ]\n");
+	}
+
+	fprintf(fp, "}\n");
+}
+
+/*
+ * Commands are a single line: show [interfaces|stats|latency|neighbors] [json]
+ * The reply is written in full to the client before closing.
+ */
+static int command(char *line, FILE *fp)
+{
+	int what = 0, json = 0;
+	char *tok;
+
+	tok = strtok(line, " \t\r\n");
+	if (!tok || strcmp(tok, "show")) {
+		fprintf(fp, "Unknown command: %s\n", tok ? tok : "");
+		return -1;
+	}
+
+	while ((tok = strtok(NULL, " \t\r\n"))) {
+		if (!strcmp(tok, "json"))
+			json = 1;
+		else if (!strncmp(tok, "interfaces", strlen(tok)))
+			what |= SHOW_INTERFACES;
+		else if (!strncmp(tok, "stats", strlen(tok)))
+			what |= SHOW_STATS;
+		else if (!strncmp(tok, "neighbors", strlen(tok)))
+			what |= SHOW_NEIGHBORS;
+		else if (!strncmp(tok, "latency", strlen(tok)))
+			what |= SHOW_LATENCY;
+		else {
+			fprintf(fp, "Unknown argument: %s\n", tok);
+			return -1;
+		}
+	}
+
+	if (!what)
+		what = SHOW_ALL;
+
+	if (json)
+		show_json(fp, what);
+	else
+		show_text(fp, what);
+
+	return 0;
+}
+
+/* Called as the command line comes in, it is complete at the newline */
+static int ctl_input(struct conn *c)
+{
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *fp;
+
+	if (!strchr(c->req, '\n'))
+		return 1;
+
+	/*
+	 * Hot restart, the client is a new ssdpd taking over our sockets.
+	 * We serve on until it acks, with a byte after the command.
+	 */
+	if (!strncmp(c->req, "handover", 8)) {
+		if (!c->state) {
+			if (handover(c->sd))
+				return 0;
+			c->state = c->req_len;
+			return 1;
+		}
+		if (c->req_len == c->state)
+			return 1;
+
+		handover_done();
+		ctl_path = NULL;	/* Path is still in use */
+		return 0;
+	}
+
+	fp = open_memstream(&buf, &len);
+	if (!fp)
+		return -1;
+	command(c->req, fp);
+	fclose(fp);
+
+	conn_reply(c, buf, len);
+
+	return 0;
+}
+
+static void ctl_recv(int sd)
+{
+	int client;
+
+	client = accept4(sd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (client < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			stats.empty_reads++;
+		else
+			logit(LOG_ERR, "ctl accept() error: %s", strerror(errno));
+		return;
+	}
+
+	conn_add(client, ctl_input, NULL);
+}
+
+int ctl_init(char *path)
+{
+	struct sockaddr_storage ss;
+	struct sockaddr_un *sun = (struct sockaddr_un *)&ss;
+	int sd;
+
+	sd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sd < 0) {
+		logit(LOG_ERR, "Failed creating ctl socket: %s", strerror(errno));
+		return -1;
+	}
+
+	memset(&ss, 0, sizeof(ss));
+	sun->sun_family = AF_UNIX;
+	strncpy(sun->sun_path, path, sizeof(sun->sun_path) - 1);
+
+	unlink(path);
+	if (bind(sd, (struct sockaddr *)sun, sizeof(*sun)) < 0) {
+		logit(LOG_ERR, "Failed binding ctl socket %s: %s", path, strerror(errno));
+		close(sd);
+		return -1;
+	}
+
+	/* Not the umask we inherited, only root and the group may connect */
+	if (chmod(path, CTL_MODE))
+		logit(LOG_WARNING, "Failed setting mode of %s: %s", path, strerror(errno));
+
+	if (listen(sd, 5) < 0) {
+		logit(LOG_ERR, "Failed setting ctl listen backlog: %s", strerror(errno));
+		close(sd);
+		unlink(path);
+		return -1;
+	}
+
+	register_socket(sd, -1, NULL, (struct sockaddr *)&ss, NULL, ctl_recv);
+	ctl_path = path;
+	ctl_sd = sd;
+
+	return 0;
+}
+
+/* Already bound and listening socket, from a hot restart */
+int ctl_adopt(int sd, char *path)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+
+	memset(&ss, 0, sizeof(ss));
+	getsockname(sd, (struct sockaddr *)&ss, &len);
+	if (register_socket(sd, -1, NULL, (struct sockaddr *)&ss, NULL, ctl_recv))
+		return -1;
+	ctl_path = path;
+	ctl_sd = sd;
+
+	return 0;
+}
+
+void ctl_exit(void)
+{
+	if (ctl_sd == -1)
+		return;
+
+	if (ctl_path)
+		unlink(ctl_path);
+	ctl_sd = -1;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,308 @@
+/* Socket filter, drop what we do not handle before it is queued
+ *
+ * Copyright (c) 2017  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.a
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#include <sys/syscall.h>
+
+#include "ssdp.h"
+
+/*
+ * On a UDP socket the filter sees the datagram from the UDP header, so
+ * the payload starts at offset 8.  Loads are big endian, hence:
+ */
+#define PAYLOAD     8
+#define MIN_LEN     (PAYLOAD + 8)	/* Enough for all tests below */
+#define M_SE        0x4d2d5345		/* "M-SE" */
+#define ARCH        0x41524348		/* "ARCH" */
+#define NOTI        0x4e4f5449		/* "NOTI" */
+#define FY          0x4659		/* "FY"   */
+#define HTTP_LC     0x68747470		/* "http", responses are matched caseless */
+#define LOWER       0x20202020
+
+#define FILTER_MAX  2			/* The IPv4 and IPv6 multicast sockets */
+
+/* Map keys, VERDICTS per filtered socket */
+enum { PASS, DROP, VERDICTS };
+
+/*
+ * Without -n the NOTIFY and response tests are made to never match, the
+ * first word is already known not to be "M-SE", and after the OR it is
+ * never 0.  Jumping past them instead is refused by the eBPF verifier,
+ * it does not load programs with unreachable instructions.
+ */
+#define NEVER_NOTI  M_SE
+#define NEVER_HTTP  0
+
+/* Classic BPF, works everywhere but cannot count */
+#define CBPF_NOTI   6
+#define CBPF_HTTP   10
+static struct sock_filter classic[] = {
+	BPF_STMT(BPF_LD  | BPF_W   | BPF_LEN, 0),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, MIN_LEN, 0, 10),
+	BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, PAYLOAD),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, M_SE, 0, 2),
+	BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, PAYLOAD + 4),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ARCH, 5, 6),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, NOTI, 0, 2),	/* CBPF_NOTI */
+	BPF_STMT(BPF_LD  | BPF_H   | BPF_ABS, PAYLOAD + 4),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, FY, 2, 3),
+	BPF_STMT(BPF_ALU | BPF_OR  | BPF_K, LOWER),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, HTTP_LC, 0, 1),	/* CBPF_HTTP */
+	BPF_STMT(BPF_RET | BPF_K, 0xffffffff),			/* accept */
+	BPF_STMT(BPF_RET | BPF_K, 0),				/* reject */
+};
+
+/*
+ * The same program in eBPF, which also counts the verdict in an array
+ * map we can read back.
+ */
+#define EBPF_NOTI   6
+#define EBPF_HTTP   8
+#define INSN(c, d, s, o, i) ((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+#define MOV(d, s)      INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define MOVI(d, i)     INSN(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define ORI(d, i)      INSN(BPF_ALU   | BPF_OR  | BPF_K, d, 0, 0, i)
+#define ADDI(d, i)     INSN(BPF_ALU64 | BPF_ADD | BPF_K, d, 0, 0, i)
+#define LDABS(sz, o)   INSN(BPF_LD    | sz | BPF_ABS, 0, 0, 0, o)
+#define LDX(sz, d, s, o) INSN(BPF_LDX | sz | BPF_MEM, d, s, o, 0)
+#define JEQI(d, i, o)  INSN(BPF_JMP   | BPF_JEQ | BPF_K, d, 0, o, i)
+#define JGEI(d, i, o)  INSN(BPF_JMP   | BPF_JGE | BPF_K, d, 0, o, i)
+#define JA(o)          INSN(BPF_JMP   | BPF_JA, 0, 0, o, 0)
+#define STX(sz, d, s, o) INSN(BPF_STX | sz | BPF_MEM, d, s, o, 0)
+#define XADD(d, s)     INSN(BPF_STX   | BPF_XADD | BPF_DW, d, s, 0, 0)
+#define LDMAP(d, fd)   INSN(BPF_LD    | BPF_DW | BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd), INSN(0, 0, 0, 0, 0)
+#define CALL(fn)       INSN(BPF_JMP   | BPF_CALL, 0, 0, 0, fn)
+#define EXIT()         INSN(BPF_JMP   | BPF_EXIT, 0, 0, 0, 0)
+
+/* Filtered sockets, prog is -1 when the classic filter is used */
+static struct {
+	int sd;
+	int prog;
+} slots[FILTER_MAX] = { { -1, -1 }, { -1, -1 } };
+
+static int map_fd = -1;
+static struct sock_fprog fprog;
+
+static int bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int map_create(void)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type    = BPF_MAP_TYPE_ARRAY;
+	attr.key_size    = sizeof(uint32_t);
+	attr.value_size  = sizeof(uint64_t);
+	attr.max_entries = FILTER_MAX * VERDICTS;
+
+	return bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int map_read(uint32_t key, uint64_t *val)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map_fd;
+	attr.key    = (uintptr_t)&key;
+	attr.value  = (uintptr_t)val;
+
+	return bpf(BPF_MAP_LOOKUP_ELEM, &attr);
+}
+
+/* Program for the socket in slot, counting at its keys in the map */
+static int ebpf_load(int neighbors, int slot)
+{
+	int key = slot * VERDICTS;
+	struct bpf_insn insn[] = {
+		MOV(6, 1),			/* LD_ABS wants the skb in r6 */
+		LDX(BPF_W, 0, 6, offsetof(struct __sk_buff, len)),
+		JGEI(0, MIN_LEN, 1),
+		JA(15),
+		LDABS(BPF_W, PAYLOAD),
+		JEQI(0, M_SE, 4),
+		JEQI(0, NOTI, 6),		/* EBPF_NOTI */
+		ORI(0, LOWER),
+		JEQI(0, HTTP_LC, 7),		/* EBPF_HTTP */
+		JA(9),
+		LDABS(BPF_W, PAYLOAD + 4),	/* M-SEARCH */
+		JEQI(0, ARCH, 4),
+		JA(6),
+		LDABS(BPF_H, PAYLOAD + 4),	/* NOTIFY */
+		JEQI(0, FY, 1),
+		JA(3),
+		MOVI(7, key + PASS),		/* accept */
+		MOVI(8, -1),
+		JA(2),
+		MOVI(7, key + DROP),		/* reject */
+		MOVI(8, 0),
+		STX(BPF_W, 10, 7, -4),		/* count, key on the stack */
+		MOV(2, 10),
+		ADDI(2, -4),
+		LDMAP(1, map_fd),
+		CALL(BPF_FUNC_map_lookup_elem),
+		JEQI(0, 0, 2),
+		MOVI(1, 1),
+		XADD(0, 1),
+		MOV(0, 8),
+		EXIT(),
+	};
+	union bpf_attr attr;
+
+	if (!neighbors) {
+		insn[EBPF_NOTI].imm = NEVER_NOTI;
+		insn[EBPF_HTTP].imm = NEVER_HTTP;
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+	attr.insns     = (uintptr_t)insn;
+	attr.insn_cnt  = sizeof(insn) / sizeof(insn[0]);
+	attr.license   = (uintptr_t)"ISC";
+
+	return bpf(BPF_PROG_LOAD, &attr);
+}
+
+/*
+ * Attach a filter to sd, one of the multicast sockets, passing only
+ * M-SEARCH, and with neighbors also NOTIFY and responses.  Prefers the
+ * eBPF version, with counters, falls back to classic BPF.
+ */
+int filter_attach(int sd, int neighbors)
+{
+	int i, prog = -1;
+
+	for (i = 0; i < FILTER_MAX; i++) {
+		if (slots[i].sd == -1)
+			break;
+	}
+	if (i == FILTER_MAX) {
+		logit(LOG_ERR, "Failed attaching socket filter, max %d sockets", FILTER_MAX);
+		return -1;
+	}
+
+	if (!fprog.len) {
+		map_fd = map_create();
+		if (!neighbors) {
+			classic[CBPF_NOTI].k = NEVER_NOTI;
+			classic[CBPF_HTTP].k = NEVER_HTTP;
+		}
+		fprog.len    = sizeof(classic) / sizeof(classic[0]);
+		fprog.filter = classic;
+	}
+
+	if (map_fd >= 0)
+		prog = ebpf_load(neighbors, i);
+	if (prog >= 0 && setsockopt(sd, SOL_SOCKET, SO_ATTACH_BPF, &prog, sizeof(prog))) {
+		close(prog);
+		prog = -1;
+	}
+	if (prog < 0) {
+		logit(LOG_NOTICE, "No eBPF socket filter, %s, filtering without counters.", strerror(errno));
+		if (setsockopt(sd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog))) {
+			logit(LOG_ERR, "Failed attaching socket filter: %s", strerror(errno));
+			return -1;
+		}
+	}
+
+	slots[i].sd   = sd;
+	slots[i].prog = prog;
+
+	return 0;
+}
+
+/* Remove a filter, e.g., one left by the ssdpd we took over from */
+void filter_detach(int sd)
+{
+	int dummy = 0;
+
+	setsockopt(sd, SOL_SOCKET, SO_DETACH_FILTER, &dummy, sizeof(dummy));
+}
+
+/* Datagrams passed and dropped by the filters, -1 if not counted */
+int filter_count(uint64_t *pass, uint64_t *drop)
+{
+	uint64_t val;
+	int i, rc = -1;
+
+	*pass = *drop = 0;
+	for (i = 0; i < FILTER_MAX; i++) {
+		if (slots[i].prog < 0)
+			continue;
+
+		if (!map_read(i * VERDICTS + PASS, &val))
+			*pass += val;
+		if (!map_read(i * VERDICTS + DROP, &val))
+			*drop += val;
+		rc = 0;
+	}
+
+	return rc;
+}
+
+/*
+ * Datagrams the filter on sd has dropped, 0 if sd is not filtered, or
+ * -1 if they are not counted.  The kernel counts them as socket drops.
+ */
+int filter_dropped(int sd, uint64_t *drop)
+{
+	int i;
+
+	*drop = 0;
+	for (i = 0; i < FILTER_MAX; i++) {
+		if (slots[i].sd != sd)
+			continue;
+
+		if (slots[i].prog < 0)
+			return -1;
+
+		return map_read(i * VERDICTS + DROP, drop);
+	}
+
+	return 0;
+}
+
+void filter_exit(void)
+{
+	int i;
+
+	for (i = 0; i < FILTER_MAX; i++) {
+		if (slots[i].prog != -1)
+			close(slots[i].prog);
+		slots[i].sd = slots[i].prog = -1;
+	}
+	if (map_fd != -1)
+		close(map_fd);
+	map_fd = -1;
+	fprog.len = 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,92 @@
+/* Log-linear latency histograms
+ *
+ * Copyright (c) 2017  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.a
+ */
+
+#include <config.h>
+#include <stdint.h>
+
+#include "ssdp.h"
+
+/*
+ * Each power of two is split in HIST_SUB linear buckets, so a bucket is
+ * at most 25% of its value wide, with exact buckets for 0-7 usec.  The
+ * last bucket, from 14.7 sec, also holds everything above.
+ */
+#define SUB_BITS  2
+#define HIST_SUB  (1 << SUB_BITS)
+
+int hist_bucket(uint64_t usec)
+{
+	int exp, idx;
+
+	if (usec < HIST_SUB)
+		return usec;
+
+	exp = 63 - __builtin_clzll(usec);
+	idx = (exp - SUB_BITS + 1) * HIST_SUB + ((usec >> (exp - SUB_BITS)) & (HIST_SUB - 1));
+	if (idx >= HIST_BUCKETS)
+		idx = HIST_BUCKETS - 1;
+
+	return idx;
+}
+
+/* Lowest value, usec, in bucket idx, the one above starts at idx + 1 */
+uint64_t hist_floor(int idx)
+{
+	int exp;
+
+	if (idx < HIST_SUB)
+		return idx;
+
+	exp = idx / HIST_SUB + SUB_BITS - 1;
+	return (uint64_t)(HIST_SUB + idx % HIST_SUB) << (exp - SUB_BITS);
+}
+
+void hist_add(struct hist *h, uint64_t usec)
+{
+	h->count[hist_bucket(usec)]++;
+	h->sum += usec;
+	h->num++;
+}
+
+/*
+ * Value at or below which permille of the samples are, as the top of
+ * the bucket it is in.  Overestimates by at most the bucket width.
+ */
+uint64_t hist_pct(struct hist *h, int permille)
+{
+	uint64_t rank, seen = 0;
+	int i;
+
+	if (!h->num)
+		return 0;
+
+	rank = (h->num * permille + 999) / 1000;
+	for (i = 0; i < HIST_BUCKETS - 1; i++) {
+		seen += h->count[i];
+		if (seen >= rank)
+			return hist_floor(i + 1) - 1;
+	}
+
+	return hist_floor(HIST_BUCKETS - 1);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
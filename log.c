@@ -0,0 +1,197 @@
+/* Logging, with an asynchronous ring for debug mode
+ *
+ * Copyright (c) 2017  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.a
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "ssdp.h"
+
+/*
+ * Single producer (the main loop), single consumer (the writer thread).
+ * Messages are formatted into the ring by the producer, the slow part,
+ * syslog(), is left to the writer.  When the ring is full messages are
+ * dropped and counted rather than stalling SSDP processing.
+ */
+#define LOG_RING_SIZE        1024	/* Power of two */
+#define LOG_MSG_LEN          256
+
+struct logmsg {
+	int  level;
+	char msg[LOG_MSG_LEN];
+};
+
+int log_mask = LOG_UPTO(LOG_NOTICE);
+
+static struct logmsg *ring;
+static atomic_size_t  head;		/* Next slot to write, producer */
+static atomic_size_t  tail;		/* Next slot to read, consumer */
+static atomic_int     sleeping;
+static atomic_int     stop;
+static atomic_ulong   dropped;
+static pthread_t      writer;
+static int            efd = -1;
+
+static void *drain(void *arg)
+{
+	unsigned long num;
+	uint64_t cnt;
+	size_t t;
+
+	(void)arg;
+	while (1) {
+		t = atomic_load_explicit(&tail, memory_order_relaxed);
+		if (t != atomic_load_explicit(&head, memory_order_acquire)) {
+			struct logmsg *m = &ring[t & (LOG_RING_SIZE - 1)];
+
+			syslog(m->level, "%s", m->msg);
+			atomic_store_explicit(&tail, t + 1, memory_order_release);
+			continue;
+		}
+
+		num = atomic_exchange(&dropped, 0);
+		if (num)
+			syslog(LOG_WARNING, "Log ring full, %lu messages dropped", num);
+
+		if (atomic_load(&stop))
+			break;
+
+		/* Recheck after announcing we sleep, or a wakeup may be lost */
+		atomic_store(&sleeping, 1);
+		if (atomic_load(&head) != t || atomic_load(&stop)) {
+			atomic_store(&sleeping, 0);
+			continue;
+		}
+
+		if (read(efd, &cnt, sizeof(cnt)) < 0 && errno != EINTR)
+			break;
+	}
+
+	return NULL;
+}
+
+void log_write(int level, const char *fmt, ...)
+{
+	struct logmsg *m;
+	uint64_t one = 1;
+	va_list ap;
+	size_t h;
+
+	va_start(ap, fmt);
+	if (!ring) {
+		vsyslog(level, fmt, ap);
+		va_end(ap);
+		return;
+	}
+
+	h = atomic_load_explicit(&head, memory_order_relaxed);
+	if (h - atomic_load_explicit(&tail, memory_order_acquire) >= LOG_RING_SIZE) {
+		atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+		va_end(ap);
+		return;
+	}
+
+	m = &ring[h & (LOG_RING_SIZE - 1)];
+	m->level = level;
+	vsnprintf(m->msg, sizeof(m->msg), fmt, ap);
+	va_end(ap);
+
+	atomic_store(&head, h + 1);
+	if (atomic_exchange(&sleeping, 0)) {
+		if (write(efd, &one, sizeof(one)) < 0) {
+			/* Counter saturated, writer is awake already */
+		}
+	}
+}
+
+/*
+ * Open syslog and set level.  With async, messages are queued in a ring
+ * and written by a background thread, falls back to syslog() on error.
+ */
+void log_init(int level, int opts, int async)
+{
+	sigset_t all, old;
+	int rc;
+
+	openlog(PACKAGE_NAME, opts, LOG_DAEMON);
+	setlogmask(LOG_UPTO(level));
+	log_mask = LOG_UPTO(level);
+
+	if (!async)
+		return;
+
+	ring = calloc(LOG_RING_SIZE, sizeof(*ring));
+	if (!ring)
+		goto fail;
+
+	efd = eventfd(0, EFD_CLOEXEC);
+	if (efd < 0)
+		goto fail;
+
+	/* Signals must interrupt poll() in the main loop, not the writer */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	rc = pthread_create(&writer, NULL, drain, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (rc) {
+		errno = rc;
+		goto fail;
+	}
+
+	return;
+fail:
+	syslog(LOG_WARNING, "Failed starting log writer, logging synchronously: %s", strerror(errno));
+	if (efd != -1)
+		close(efd);
+	efd = -1;
+	free(ring);
+	ring = NULL;
+}
+
+/* Flush any queued messages and close syslog */
+void log_exit(void)
+{
+	uint64_t one = 1;
+
+	if (ring) {
+		atomic_store(&stop, 1);
+		if (write(efd, &one, sizeof(one)) < 0) {
+			/* Writer checks stop before sleeping */
+		}
+		pthread_join(writer, NULL);
+		close(efd);
+		free(ring);
+		ring = NULL;
+	}
+
+	closelog();
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,171 @@
+/* Stats segment, counters published in shared memory for external readers
+ *
+ * Copyright (c) 2017  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.a
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ssdp.h"
+
+/*
+ * The counters stay where they are, plain integers bumped on the hot
+ * path, and are copied to the segment from a timer.  There is a single
+ * writer, so the seqlock needs no atomic read-modify-write, only the
+ * ordering of the seq stores around the copy.
+ *
+ * The segment is created under a temporary name and renamed, so on a
+ * hot restart the new daemon takes over the path while the old one is
+ * still running.  The old one then leaves it in place at exit.
+ */
+static struct shm_stats *seg;
+static struct timer      shm_timer;
+static char             *seg_file;
+static dev_t             seg_dev;
+static ino_t             seg_ino;
+
+static void total(struct ifstats *sum)
+{
+	struct ifsock *ifs;
+
+	memset(sum, 0, sizeof(*sum));
+	IFS_FOREACH(ifs) {
+		struct ifstats *st = &ifs->stats;
+
+		sum->rx_pkts     += st->rx_pkts;
+		sum->rx_bytes    += st->rx_bytes;
+		sum->tx_pkts     += st->tx_pkts;
+		sum->tx_bytes    += st->tx_bytes;
+		sum->msearch     += st->msearch;
+		sum->unsupported += st->unsupported;
+		sum->replies     += st->replies;
+		sum->notify      += st->notify;
+		sum->send_err    += st->send_err;
+
+		if (!st->lat_num)
+			continue;
+		if (!sum->lat_num || st->lat_min < sum->lat_min)
+			sum->lat_min = st->lat_min;
+		if (st->lat_max > sum->lat_max)
+			sum->lat_max = st->lat_max;
+		sum->lat_sum += st->lat_sum;
+		sum->lat_num += st->lat_num;
+	}
+}
+
+static void update(void *arg, uint64_t now)
+{
+	uint32_t seq;
+	int i;
+
+	(void)arg;
+
+	seq = seg->seq;
+	__atomic_store_n(&seg->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	seg->updated     = time(NULL);
+	seg->ifaces      = ift.num;
+	seg->iface_bytes = socket_memory();
+	seg->neighbors   = cache_count();
+	seg->filtered    = !filter_count(&seg->filter_pass, &seg->filter_drop);
+	seg->stats       = stats;
+	total(&seg->total);
+	for (i = 0; i < SSDP_TYPES; i++) {
+		strncpy(seg->st[i], supported_types[i], SHM_ST_LEN - 1);
+		seg->lat[i] = st_lat[i];
+	}
+
+	__atomic_store_n(&seg->seq, seq + 2, __ATOMIC_RELEASE);
+
+	timer_start(&shm_timer, now + SHM_INTERVAL, update, NULL);
+}
+
+int shm_init(char *file)
+{
+	struct stat st;
+	char tmp[256];
+	void *map;
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		goto fail;
+
+	if (ftruncate(fd, sizeof(*seg)) || fstat(fd, &st))
+		goto fail_close;
+
+	map = mmap(NULL, sizeof(*seg), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto fail_close;
+	close(fd);
+
+	seg = map;
+	seg->magic   = SHM_MAGIC;
+	seg->version = SHM_VERSION;
+	seg->types   = SSDP_TYPES;
+	seg->size    = sizeof(*seg);
+	seg->pid     = getpid();
+
+	if (rename(tmp, file)) {
+		munmap(seg, sizeof(*seg));
+		seg = NULL;
+		goto fail_unlink;
+	}
+	seg_file = file;
+	seg_dev  = st.st_dev;
+	seg_ino  = st.st_ino;
+
+	update(NULL, timer_now());
+
+	return 0;
+fail_close:
+	close(fd);
+fail_unlink:
+	unlink(tmp);
+fail:
+	logit(LOG_WARNING, "Failed creating stats segment %s: %s", file, strerror(errno));
+	return -1;
+}
+
+/* Remove the segment, unless a new daemon has replaced it */
+void shm_exit(void)
+{
+	struct stat st;
+
+	if (!seg)
+		return;
+
+	timer_stop(&shm_timer);
+	if (!stat(seg_file, &st) && st.st_dev == seg_dev && st.st_ino == seg_ino)
+		unlink(seg_file);
+	munmap(seg, sizeof(*seg));
+	seg = NULL;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,431 @@
+/* Warm-start snapshot, announce at boot before the interface scan
+ *
+ * Copyright (c) 2017  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.a
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ssdp.h"
+
+/*
+ * The snapshot is a header followed by one record per interface address,
+ * each with its NOTIFY packets, ready to send.  It is only read by the
+ * same build on the same host, so native byte order and no padding
+ * tricks, records are 4 byte aligned.  NOTIFY has no Date header, so
+ * the packets are byte for byte what announce() would send.
+ */
+#define SNAP_MAGIC           0x53534453	/* "SSDS" */
+#define SNAP_VERSION         1
+#define SNAP_ALIGN(len)      (((len) + 3) & ~3)
+
+struct snap_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t pad;
+	uint32_t num;			/* Interface records */
+	uint32_t len;			/* Total, header included */
+	char     uuid[42];
+	char     server[64];
+};
+
+struct snap_ifs {
+	uint32_t len;			/* Record, packets included */
+	uint16_t family;
+	uint16_t pkts;
+	char     ifname[IF_NAMESIZE];
+	uint8_t  addr[16];
+	/* pkts times: uint16_t length, packet */
+};
+
+static char   *image;			/* Current snapshot, mapped or rendered */
+static size_t  image_len;
+static int     mapped;
+static uint8_t *sent;			/* Per record, announced from snapshot */
+
+static void *addr_of(struct sockaddr_storage *ss)
+{
+	if (ss->ss_family == AF_INET6)
+		return &((struct sockaddr_in6 *)ss)->sin6_addr;
+
+	return &((struct sockaddr_in *)ss)->sin_addr;
+}
+
+static size_t addr_len(int family)
+{
+	return family == AF_INET6 ? sizeof(struct in6_addr) : sizeof(struct in_addr);
+}
+
+static void drop(void)
+{
+	if (mapped)
+		munmap(image, image_len);
+	else
+		free(image);
+	image = NULL;
+	image_len = 0;
+	mapped = 0;
+	free(sent);
+	sent = NULL;
+}
+
+/* Next record, or NULL at the end or if it does not fit in the image */
+static struct snap_ifs *next(struct snap_ifs *rec)
+{
+	size_t off;
+
+	if (!rec)
+		off = SNAP_ALIGN(sizeof(struct snap_hdr));
+	else
+		off = (char *)rec - image + rec->len;
+
+	if (off + sizeof(*rec) > image_len)
+		return NULL;
+	rec = (struct snap_ifs *)(image + off);
+	if (rec->len < sizeof(*rec) || rec->len > image_len - off || rec->len & 3)
+		return NULL;
+
+	return rec;
+}
+
+static int valid(void)
+{
+	struct snap_hdr *hdr = (struct snap_hdr *)image;
+	struct snap_ifs *rec = NULL;
+	uint32_t i;
+
+	if (image_len < sizeof(*hdr) || hdr->magic != SNAP_MAGIC ||
+	    hdr->version != SNAP_VERSION || hdr->len != image_len)
+		return 0;
+
+	for (i = 0; i < hdr->num; i++) {
+		char *pkt, *end;
+		uint16_t j, len;
+
+		rec = next(rec);
+		if (!rec)
+			return 0;
+		if (rec->family != AF_INET && rec->family != AF_INET6)
+			return 0;
+		if (!memchr(rec->ifname, 0, sizeof(rec->ifname)))
+			return 0;
+
+		pkt = (char *)(rec + 1);
+		end = (char *)rec + rec->len;
+		for (j = 0; j < rec->pkts; j++) {
+			if (pkt + sizeof(len) > end)
+				return 0;
+			memcpy(&len, pkt, sizeof(len));
+			pkt += sizeof(len) + len;
+			if (pkt > end)
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Map the snapshot, it is only used if its UUID and server string are
+ * the ones we have now.  Returns the number of interface records, or
+ * -1 if there is no usable one.
+ */
+int snap_load(char *file)
+{
+	struct snap_hdr *hdr;
+	struct stat st;
+	int fd;
+
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			logit(LOG_WARNING, "Failed opening snapshot %s: %s", file, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		return -1;
+	}
+
+	image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED) {
+		image = NULL;
+		return -1;
+	}
+	image_len = st.st_size;
+	mapped = 1;
+
+	if (!valid()) {
+		logit(LOG_WARNING, "Ignoring invalid or old snapshot %s", file);
+		drop();
+		return -1;
+	}
+
+	hdr = (struct snap_hdr *)image;
+	if (strncmp(hdr->uuid, uuid, sizeof(hdr->uuid)) ||
+	    strncmp(hdr->server, server_string, sizeof(hdr->server))) {
+		logit(LOG_NOTICE, "Ignoring snapshot %s, it is for %.*s", file,
+		      (int)sizeof(hdr->uuid), hdr->uuid);
+		drop();
+		return -1;
+	}
+
+	return hdr->num;
+}
+
+/*
+ * Send all NOTIFY in the snapshot, on temporary sockets.  Interfaces
+ * that are gone, or not up yet, are skipped, the scan catches up.
+ * Returns the number of interface addresses announced.
+ */
+int snap_announce(void)
+{
+	struct snap_hdr *hdr = (struct snap_hdr *)image;
+	struct snap_ifs *rec = NULL;
+	int sd[2], ttl = 2, off = 0;
+	int num = 0;
+	uint32_t i;
+
+	if (!image)
+		return 0;
+
+	sent = calloc(hdr->num, 1);
+	if (!sent)
+		return 0;
+
+	sd[0] = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	sd[1] = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sd[0] != -1) {
+		setsockopt(sd[0], IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+		setsockopt(sd[0], IPPROTO_IP, IP_MULTICAST_LOOP, &off, sizeof(off));
+	}
+	if (sd[1] != -1)
+		setsockopt(sd[1], IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &off, sizeof(off));
+
+	for (i = 0; i < hdr->num; i++) {
+		struct sockaddr_storage dest;
+		struct ifsock ifs;
+		char *pkt;
+		uint16_t j, len;
+
+		rec = next(rec);
+
+		memset(&ifs, 0, sizeof(ifs));
+		ifs.out = sd[rec->family == AF_INET6];
+		ifs.ifindex = if_nametoindex(rec->ifname);
+		if (ifs.out == -1 || !ifs.ifindex)
+			continue;
+
+		ifs.addr.ss_family = rec->family;
+		memcpy(addr_of(&ifs.addr), rec->addr, addr_len(rec->family));
+		if (rec->family == AF_INET6)
+			compose_addr6((struct sockaddr_in6 *)&dest, MC_SSDP_GROUP_IPV6, MC_SSDP_PORT);
+		else
+			compose_addr((struct sockaddr_in *)&dest, MC_SSDP_GROUP, MC_SSDP_PORT);
+
+		pkt = (char *)(rec + 1);
+		for (j = 0; j < rec->pkts; j++) {
+			memcpy(&len, pkt, sizeof(len));
+			pkt += sizeof(len);
+			if (ssdp_send(&ifs, pkt, len, (struct sockaddr *)&dest) < 0)
+				break;
+			pkt += len;
+		}
+
+		if (j == rec->pkts) {
+			sent[i] = 1;
+			num++;
+		}
+	}
+
+	if (sd[0] != -1)
+		close(sd[0]);
+	if (sd[1] != -1)
+		close(sd[1]);
+
+	return num;
+}
+
+/*
+ * Returns 1 if ifs was announced from the snapshot, its first NOTIFY
+ * can then wait.  Linear, only used once after the first scan.
+ */
+int snap_announced(struct ifsock *ifs)
+{
+	struct snap_hdr *hdr = (struct snap_hdr *)image;
+	struct snap_ifs *rec = NULL;
+	uint32_t i;
+
+	if (!image || !sent)
+		return 0;
+
+	for (i = 0; i < hdr->num; i++) {
+		rec = next(rec);
+		if (!sent[i] || rec->family != ifs->addr.ss_family)
+			continue;
+		if (strncmp(rec->ifname, ifs->ifname, sizeof(rec->ifname)))
+			continue;
+		if (!memcmp(rec->addr, addr_of(&ifs->addr), addr_len(rec->family)))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int render(char **buf, size_t *len)
+{
+	struct snap_hdr *hdr;
+	struct ifsock *ifs;
+	size_t num = 0, max, off;
+	char *img;
+
+	/* Upper bound, trimmed by the actual packet lengths */
+	IFS_FOREACH(ifs)
+		num++;
+	for (max = 0; supported_types[max]; max++)
+		;
+	max = SNAP_ALIGN(sizeof(*hdr)) + num * (sizeof(struct snap_ifs) + max * (2 + SEND_PKT_SIZE) + 3);
+
+	img = calloc(1, max);
+	if (!img)
+		return -1;
+
+	hdr = (struct snap_hdr *)img;
+	hdr->magic   = SNAP_MAGIC;
+	hdr->version = SNAP_VERSION;
+	memcpy(hdr->uuid, uuid, sizeof(hdr->uuid));
+	memcpy(hdr->server, server_string, sizeof(hdr->server));
+
+	off = SNAP_ALIGN(sizeof(*hdr));
+	IFS_FOREACH(ifs) {
+		char host[NI_MAXHOST + 2];
+		struct snap_ifs *rec;
+		char *pkt;
+		size_t i;
+
+		if (ifs->out == -1 || compose_host(ifs, host, sizeof(host)))
+			continue;
+
+		rec = (struct snap_ifs *)(img + off);
+		rec->family = ifs->addr.ss_family;
+		memcpy(rec->ifname, ifs->ifname, sizeof(rec->ifname));
+		memcpy(rec->addr, addr_of(&ifs->addr), addr_len(rec->family));
+
+		pkt = (char *)(rec + 1);
+		for (i = 0; supported_types[i]; i++) {
+			uint16_t len;
+
+			/* Same as announce(), the UUID is sent for SSDP_ST_ALL */
+			if (!strcmp(supported_types[i], uuid))
+				continue;
+
+			compose_notify(!strcmp(supported_types[i], SSDP_ST_ALL) ? NULL : supported_types[i],
+				       host, pkt + sizeof(len), SEND_PKT_SIZE);
+			len = strlen(pkt + sizeof(len));
+			memcpy(pkt, &len, sizeof(len));
+			pkt += sizeof(len) + len;
+			rec->pkts++;
+		}
+
+		rec->len = SNAP_ALIGN(pkt - (char *)rec);
+		off += rec->len;
+		hdr->num++;
+	}
+	hdr->len = off;
+
+	*buf = img;
+	*len = off;
+
+	return 0;
+}
+
+/*
+ * Render the snapshot from the interface table and write it, unless it
+ * is unchanged, to save flash wear.  Written to a temporary file first
+ * and renamed, so a reader never sees a partial snapshot.
+ */
+int snap_save(char *file)
+{
+	char tmp[256];
+	size_t len, off = 0;
+	char *buf;
+	int fd;
+
+	if (render(&buf, &len))
+		return -1;
+
+	if (image && image_len == len && !memcmp(image, buf, len)) {
+		free(buf);
+		return 0;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		goto fail;
+
+	while (off < len) {
+		ssize_t num;
+
+		num = write(fd, buf + off, len - off);
+		if (num < 0) {
+			if (errno == EINTR)
+				continue;
+			close(fd);
+			unlink(tmp);
+			goto fail;
+		}
+		off += num;
+	}
+
+	if (close(fd) || rename(tmp, file)) {
+		unlink(tmp);
+		goto fail;
+	}
+
+	logit(LOG_DEBUG, "Saved snapshot %s, %zu bytes", file, len);
+	drop();
+	image = buf;
+	image_len = len;
+
+	return 0;
+fail:
+	logit(LOG_WARNING, "Failed saving snapshot %s: %s", file, strerror(errno));
+	free(buf);
+	return -1;
+}
+
+void snap_exit(void)
+{
+	drop();
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,1402 @@
+/* SSDP protocol, message composition and parsing, interface lookup
+ *
+ * Copyright (c) 2017  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.a
+ */
+
+#include <config.h>
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/param.h>		/* MAX() */
+#include <sys/socket.h>
+#include <linux/sock_diag.h>		/* SK_MEMINFO_DROPS */
+
+#include "ssdp.h"
+
+struct iftab ift;
+struct stats stats;
+
+/* Reply latency per ST, in supported_types[] order */
+struct hist st_lat[SSDP_TYPES];
+
+char uuid[42];
+char server_string[64] = "POSIX UPnP/1.0 " PACKAGE_NAME "/" PACKAGE_VERSION;
+
+/* Replaced by test harnesses to capture what would be sent */
+ssize_t (*ssdp_sendmsg)(int, const struct msghdr *, int) = sendmsg;
+int     (*ssdp_sendmmsg)(int, struct mmsghdr *, unsigned int, int) = sendmmsg;
+
+/* Default from configure, can be changed in the config file */
+char device_type[128] = DEVICE_TYPE;
+
+/* Max socket buffer size, KiB, they grow when datagrams are dropped */
+int bufmax = BUFFER_MAX;
+
+/* Proxy mode, answer M-SEARCH on the others for neighbors on these */
+char upstream[UPSTREAM_MAX][IF_NAMESIZE];
+int  upnum;
+
+char *supported_types[SSDP_TYPES + 1] = {
+	SSDP_ST_ALL,
+	"upnp:rootdevice",
+	device_type,
+	uuid,
+	NULL
+};
+
+/* Find interface in same subnet as sa */
+struct ifsock *find_outbound(struct sockaddr *sa)
+{
+	in_addr_t cand;
+	size_t i;
+
+	cand = ((struct sockaddr_in *)sa)->sin_addr.s_addr;
+	for (i = ift.num; i-- > 0;) {
+		struct ifkey *k = &ift.key[i];
+
+		if (k->family != AF_INET)
+			continue;
+		if (k->addr.v4 == htonl(INADDR_ANY) || k->mask == htonl(INADDR_ANY))
+			continue;
+
+		if ((k->addr.v4 & k->mask) == (cand & k->mask))
+			return k->ifs;
+	}
+
+	return NULL;
+}
+
+struct ifsock *find_outbound6(struct sockaddr *sa)
+{
+	struct in6_addr cand;
+	size_t i;
+
+	cand = ((struct sockaddr_in6 *)sa)->sin6_addr;
+	for (i = ift.num; i-- > 0;) {
+		struct ifkey *k = &ift.key[i];
+
+		if (k->family != AF_INET6)
+			continue;
+		if (IN6_IS_ADDR_UNSPECIFIED(&k->addr.v6))
+			continue;
+
+		if (IN6_ARE_ADDR_EQUAL(&k->addr.v6, &cand))
+			return k->ifs;
+
+		if (IN6_IS_ADDR_LINKLOCAL(&k->addr.v6))
+			return k->ifs;
+	}
+
+	return NULL;
+}
+
+/*
+ * Interface sa sent to us on, ifindex is where the packet arrived, from
+ * IP_PKTINFO/IPV6_PKTINFO.  For IPv4 sa must also be in the subnet, for
+ * IPv6 our own address on that interface is preferred, then link-local.
+ * Without ifindex, e.g. from a capture, it is found by address only.
+ */
+struct ifsock *find_ingress(struct sockaddr *sa, int ifindex)
+{
+	struct ifsock *ifs = NULL;
+	size_t i;
+
+	if (!ifindex)
+		return sa->sa_family == AF_INET ? find_outbound(sa) : find_outbound6(sa);
+
+	for (i = ift.num; i-- > 0;) {
+		struct ifkey *k = &ift.key[i];
+
+		if (k->family != sa->sa_family || k->ifindex != ifindex)
+			continue;
+
+		if (k->family == AF_INET) {
+			in_addr_t cand = ((struct sockaddr_in *)sa)->sin_addr.s_addr;
+
+			if (k->addr.v4 == htonl(INADDR_ANY) || k->mask == htonl(INADDR_ANY))
+				continue;
+			if ((k->addr.v4 & k->mask) == (cand & k->mask))
+				return k->ifs;
+		} else {
+			struct in6_addr *cand = &((struct sockaddr_in6 *)sa)->sin6_addr;
+
+			if (IN6_IS_ADDR_UNSPECIFIED(&k->addr.v6))
+				continue;
+			if (IN6_ARE_ADDR_EQUAL(&k->addr.v6, cand))
+				return k->ifs;
+			if (!ifs || IN6_IS_ADDR_LINKLOCAL(&k->addr.v6))
+				ifs = k->ifs;
+		}
+	}
+
+	return ifs;
+}
+
+/* Exact match, must be same ifaddr as sa */
+struct ifsock *find_iface(struct sockaddr *sa)
+{
+	size_t i;
+
+	if (!sa)
+		return NULL;
+
+	for (i = ift.num; i-- > 0;) {
+		struct ifkey *k = &ift.key[i];
+
+		if (k->family != sa->sa_family)
+			continue;
+
+		if (sa->sa_family == AF_INET) {
+			struct sockaddr_in *addr = (struct sockaddr_in *)sa;
+
+			if (k->addr.v4 == addr->sin_addr.s_addr)
+				return k->ifs;
+		} else if (sa->sa_family == AF_INET6) {
+			struct sockaddr_in6 *addr = (struct sockaddr_in6 *)sa;
+
+			/* ipv6 listen on in6addr_any */
+			if (IN6_ARE_ADDR_EQUAL(&addr->sin6_addr, &k->addr.v6) ||
+			    IN6_IS_ADDR_UNSPECIFIED(&addr->sin6_addr))
+				return k->ifs;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Handler per descriptor, for dispatch_socket().  The multicast and
+ * shared outbound sockets are used by many entries, so each handler
+ * counts its users and is cleared with the last.  It also keeps track
+ * of the datagrams the kernel has dropped on the socket.
+ */
+struct handler {
+	void (*cb)(int sd);
+	unsigned int refs;
+
+	uint32_t ovfl;			/* Last SO_RXQ_OVFL count */
+	uint64_t drops;			/* ... as 64 bits, since registered */
+	uint64_t lost;			/* ... of which for lack of buffer */
+	int      full;			/* Buffer at bufmax, warned about */
+};
+
+static struct handler *handlers;
+static size_t handler_max;
+
+static int handler_reserve(int sd)
+{
+	struct handler *tmp;
+	size_t max;
+
+	if (sd < 0 || (size_t)sd < handler_max)
+		return 0;
+
+	max = handler_max ? handler_max : 64;
+	while (max <= (size_t)sd)
+		max *= 2;
+
+	tmp = realloc(handlers, max * sizeof(*tmp));
+	if (!tmp)
+		return -1;
+	memset(&tmp[handler_max], 0, (max - handler_max) * sizeof(*tmp));
+
+	handlers    = tmp;
+	handler_max = max;
+
+	return 0;
+}
+
+/*
+ * Every receive socket reports the number of datagrams dropped with the
+ * next one received, when, and on which interface, it arrived.  The
+ * count is since the socket was created, which on hot restart is before
+ * we got it, so start from where it is now.
+ */
+static uint32_t rxq_init(int sd)
+{
+	uint32_t mem[SK_MEMINFO_VARS] = { 0 };
+	socklen_t len = sizeof(mem);
+	int on = 1;
+
+	setsockopt(sd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+	setsockopt(sd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+	setsockopt(sd, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on));
+	setsockopt(sd, IPPROTO_IPV6, IPV6_RECVPKTINFO, &on, sizeof(on));
+	if (getsockopt(sd, SOL_SOCKET, SO_MEMINFO, mem, &len))
+		return 0;
+
+	return mem[SK_MEMINFO_DROPS];
+}
+
+static void handler_add(int sd, void (*cb)(int))
+{
+	struct handler *h;
+
+	if (sd < 0)
+		return;
+
+	h = &handlers[sd];
+	if (!h->refs) {
+		memset(h, 0, sizeof(*h));
+		h->ovfl = rxq_init(sd);
+	}
+	h->cb = cb;
+	h->refs++;
+}
+
+static void handler_del(int sd)
+{
+	if (sd < 0 || (size_t)sd >= handler_max || !handlers[sd].refs)
+		return;
+
+	if (--handlers[sd].refs == 0)
+		handlers[sd].cb = NULL;
+}
+
+/* Call the handler for a readable socket, one per descriptor */
+int dispatch_socket(int sd)
+{
+	if (sd < 0 || (size_t)sd >= handler_max || !handlers[sd].cb)
+		return -1;
+
+	stats.events++;
+	handlers[sd].cb(sd);
+
+	return 0;
+}
+
+/*
+ * Double the SO_RCVBUF or SO_SNDBUF of sd, up to bufmax.  As root the
+ * net.core.[rw]mem_max sysctl limit does not apply.  Returns 0 if it
+ * grew, -1 if it is already at bufmax, or could not be changed.
+ */
+int socket_grow(int sd, int opt)
+{
+	socklen_t len = sizeof(int);
+	int cur, val;
+
+	if (getsockopt(sd, SOL_SOCKET, opt, &cur, &len) || cur >= bufmax * 1024)
+		return -1;
+
+	/* The kernel reports, and uses, twice what is set */
+	val = MIN(cur * 2, bufmax * 1024) / 2;
+	if (setsockopt(sd, SOL_SOCKET, opt == SO_RCVBUF ? SO_RCVBUFFORCE : SO_SNDBUFFORCE, &val, sizeof(val)) &&
+	    setsockopt(sd, SOL_SOCKET, opt, &val, sizeof(val)))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Called with count from the SO_RXQ_OVFL control message of a datagram
+ * received on sd.  Datagrams dropped by our socket filter are included
+ * in the count, they are subtracted, the rest were lost because the
+ * receive queue was full, then the buffer is grown.  The filter count
+ * is read after the datagram was queued, so the loss may be seen late,
+ * but is never overcounted.
+ */
+void socket_dropped(int sd, uint32_t count)
+{
+	struct handler *h;
+	uint64_t filtered, lost;
+	socklen_t len = sizeof(int);
+	int size = 0;
+
+	if (sd < 0 || (size_t)sd >= handler_max)
+		return;
+
+	h = &handlers[sd];
+	if (count == h->ovfl)
+		return;
+	h->drops += (uint32_t)(count - h->ovfl);
+	h->ovfl   = count;
+
+	if (filter_dropped(sd, &filtered))
+		return;		/* Classic filter, cannot tell them apart */
+	if (h->drops <= filtered || h->drops - filtered <= h->lost)
+		return;
+
+	lost = h->drops - filtered;
+	stats.rx_drops += lost - h->lost;
+	h->lost = lost;
+
+	if (!socket_grow(sd, SO_RCVBUF)) {
+		getsockopt(sd, SOL_SOCKET, SO_RCVBUF, &size, &len);
+		logit(LOG_NOTICE, "Socket %d lost %llu datagrams, receive buffer grown to %d bytes",
+		      sd, (unsigned long long)lost, size);
+	} else if (!h->full) {
+		logit(LOG_WARNING, "Socket %d lost %llu datagrams, receive buffer at max, see -q",
+		      sd, (unsigned long long)lost);
+		h->full = 1;
+	}
+}
+
+/* Unused entries, and all slabs, for free_sockets() */
+static LIST_HEAD(, ifsock) pool = LIST_HEAD_INITIALIZER();
+static struct ifsock **slabs;
+static size_t slab_num;
+static size_t hist_num;		/* Latency histograms allocated */
+
+static void lat_free(struct ifsock *ifs)
+{
+	if (!ifs->lat)
+		return;
+
+	free(ifs->lat);
+	ifs->lat = NULL;
+	hist_num--;
+}
+
+static struct ifsock *ifs_alloc(void)
+{
+	struct ifsock *ifs, **tmp;
+	size_t i;
+
+	if (LIST_EMPTY(&pool)) {
+		tmp = realloc(slabs, (slab_num + 1) * sizeof(*slabs));
+		if (!tmp)
+			return NULL;
+		slabs = tmp;
+
+		ifs = calloc(IFS_SLAB, sizeof(*ifs));
+		if (!ifs)
+			return NULL;
+		slabs[slab_num++] = ifs;
+
+		for (i = IFS_SLAB; i > 0; i--)
+			LIST_INSERT_HEAD(&pool, &ifs[i - 1], link);
+	}
+
+	ifs = LIST_FIRST(&pool);
+	LIST_REMOVE(ifs, link);
+	memset(ifs, 0, sizeof(*ifs));
+
+	return ifs;
+}
+
+static int key_reserve(void)
+{
+	struct ifkey *tmp;
+	size_t max;
+
+	if (ift.num < ift.max)
+		return 0;
+
+	max = ift.max ? ift.max * 2 : IFS_SLAB;
+	tmp = realloc(ift.key, max * sizeof(*tmp));
+	if (!tmp)
+		return -1;
+
+	ift.key = tmp;
+	ift.max = max;
+
+	return 0;
+}
+
+int register_socket(int in, int out, char *ifname, struct sockaddr *addr, struct sockaddr *mask, void (*cb)(int sd))
+{
+	struct ifsock *ifs;
+	struct ifkey *k;
+	struct sockaddr_in *address = (struct sockaddr_in *)addr;
+	struct sockaddr_in *netmask = (struct sockaddr_in *)mask;
+
+	compact_sockets();
+	if (key_reserve() || handler_reserve(MAX(in, out)) || !(ifs = ifs_alloc())) {
+		char *host = inet_ntoa(address->sin_addr);
+
+		logit(LOG_ERR, "Failed registering host %s socket: %s", host, strerror(errno));
+		return -1;
+	}
+
+	ifs->in   = in;
+	ifs->out  = out;
+	ifs->mod  = 1;
+	ifs->cb   = cb;
+	ifs->addr = * (struct sockaddr_storage *) address;
+	if (ifname)
+		strncpy(ifs->ifname, ifname, sizeof(ifs->ifname) - 1);
+	if (mask)
+		ifs->mask = *netmask;
+
+	k = &ift.key[ift.num];
+	memset(k, 0, sizeof(*k));
+	k->family = addr->sa_family;
+	if (k->family == AF_INET) {
+		k->addr.v4 = address->sin_addr.s_addr;
+		k->mask    = ifs->mask.sin_addr.s_addr;
+	} else if (k->family == AF_INET6) {
+		k->addr.v6 = ((struct sockaddr_in6 *)addr)->sin6_addr;
+	}
+	k->ifindex = ifname ? if_nametoindex(ifname) : 0;
+	k->in   = in;
+	k->out  = out;
+	k->ifs  = ifs;
+	ifs->key = ift.num++;
+
+	handler_add(in, cb);
+	handler_add(out, cb);
+
+	return 0;
+}
+
+/*
+ * Removed entries leave a hole in the key array, so that IFS_FOREACH()
+ * is not disturbed, until the next compact_sockets().  The NOTIFY timer
+ * is stopped, but sockets are not closed, that is up to the caller.
+ */
+void unregister_socket(struct ifsock *ifs)
+{
+	struct ifkey *k = &ift.key[ifs->key];
+
+	timer_stop(&ifs->notify);
+	handler_del(ifs->in);
+	handler_del(ifs->out);
+	lat_free(ifs);
+	memset(k, 0, sizeof(*k));
+	k->in  = -1;
+	k->out = -1;
+	ift.holes++;
+
+	LIST_INSERT_HEAD(&pool, ifs, link);
+}
+
+/* Close the holes left by unregister_socket(), keeping the order */
+void compact_sockets(void)
+{
+	size_t i, n = 0;
+
+	if (!ift.holes)
+		return;
+
+	for (i = 0; i < ift.num; i++) {
+		if (!ift.key[i].ifs)
+			continue;
+
+		if (n != i) {
+			ift.key[n] = ift.key[i];
+			ift.key[n].ifs->key = n;
+		}
+		n++;
+	}
+
+	ift.num   = n;
+	ift.holes = 0;
+}
+
+void free_sockets(void)
+{
+	struct ifsock *ifs;
+
+	IFS_FOREACH(ifs) {
+		timer_stop(&ifs->notify);
+		lat_free(ifs);
+	}
+
+	while (slab_num > 0)
+		free(slabs[--slab_num]);
+	free(slabs);
+	slabs = NULL;
+	LIST_INIT(&pool);
+
+	free(ift.key);
+	memset(&ift, 0, sizeof(ift));
+
+	free(handlers);
+	handlers = NULL;
+	handler_max = 0;
+}
+
+/* Heap used by the interface table, in bytes */
+size_t socket_memory(void)
+{
+	return ift.max * sizeof(struct ifkey) + handler_max * sizeof(struct handler) +
+		slab_num * (IFS_SLAB * sizeof(struct ifsock) + sizeof(*slabs)) +
+		hist_num * sizeof(struct hist);
+}
+
+void compose_addr(struct sockaddr_in *sin, char *group, int port)
+{
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family      = AF_INET;
+	sin->sin_port        = htons(port);
+	sin->sin_addr.s_addr = inet_addr(group);
+}
+
+void compose_addr6(struct sockaddr_in6 *sin, char *group, int port)
+{
+	memset(sin, 0, sizeof(*sin));
+	sin->sin6_family      = AF_INET6;
+	sin->sin6_port        = htons(port);
+	inet_pton(AF_INET6, group, &sin->sin6_addr);
+}
+
+void compose_response(char *type, char *host, char *buf, size_t len)
+{
+	char usn[256];
+	char date[42];
+	time_t now;
+
+	/* RFC1123 date, as specified in RFC2616 */
+	now = time(NULL);
+	strftime(date, sizeof(date), "%a, %d %b %Y %T %Z", gmtime(&now));
+
+	if (!type)
+		type = uuid;
+	if (!strcmp(type, uuid))
+		strncpy(usn, uuid, sizeof(usn));
+	else
+		snprintf(usn, sizeof(usn), "%s::%s", uuid, type);
+
+	snprintf(buf, len, "HTTP/1.1 200 OK\r\n"
+		 "Server: %s\r\n"
+		 "Date: %s\r\n"
+		 "Location: http://%s:%d%s\r\n"
+		 "ST: %s\r\n"
+		 "EXT: \r\n"
+		 "USN: %s\r\n"
+		 "Cache-Control: max-age=%d\r\n"
+		 "\r\n",
+		 server_string,
+		 date,
+		 host, LOCATION_PORT, LOCATION_DESC,
+		 type,
+		 usn,
+		 CACHE_TIMEOUT);
+}
+
+/*
+ * M-SEARCH replies are assembled from prebuilt segments, in the same
+ * order and with the same content as compose_response():
+ *
+ *   HTTP/1.1 200 OK, Server, "Date: "   on identity change
+ *   <date>                              once per second
+ *   Location                            per interface, on first use
+ *   ST, EXT, USN, Cache-Control         per search type
+ *
+ * The identity is checked on each call, rather than being invalidated,
+ * so it can be changed by plain assignment, as the test harnesses do.
+ * A segment holds the longest ST and USN, both of which may carry the
+ * device type, with room to spare for the fixed text around them.
+ */
+struct segment {
+	char   buf[2 * sizeof(device_type) + sizeof(uuid) + 64];
+	size_t len;
+};
+
+static struct segment head;
+static struct segment types[sizeof(supported_types) / sizeof(supported_types[0]) - 1];
+static char   seg_uuid[sizeof(uuid)];
+static char   seg_server[sizeof(server_string)];
+static char   seg_type[sizeof(device_type)];
+
+static void segments(void)
+{
+	size_t i;
+
+	if (!strcmp(seg_uuid, uuid) && !strcmp(seg_server, server_string) &&
+	    !strcmp(seg_type, device_type) && head.len)
+		return;
+
+	strcpy(seg_uuid, uuid);
+	strcpy(seg_server, server_string);
+	strcpy(seg_type, device_type);
+
+	head.len = snprintf(head.buf, sizeof(head.buf), "HTTP/1.1 200 OK\r\n"
+			    "Server: %s\r\n"
+			    "Date: ", server_string);
+
+	for (i = 0; supported_types[i]; i++) {
+		char *type = supported_types[i];
+		char usn[sizeof(uuid) + sizeof(device_type) + 2];
+		int len;
+
+		if (!strcmp(type, uuid))
+			strcpy(usn, uuid);
+		else
+			snprintf(usn, sizeof(usn), "%s::%s", uuid, type);
+
+		len = snprintf(types[i].buf, sizeof(types[i].buf),
+			       "ST: %s\r\n"
+			       "EXT: \r\n"
+			       "USN: %s\r\n"
+			       "Cache-Control: max-age=%d\r\n"
+			       "\r\n", type, usn, CACHE_TIMEOUT);
+
+		/* Never send a truncated reply, fall back to compose_response() */
+		if (len < 0 || (size_t)len >= sizeof(types[i].buf))
+			len = 0;
+		types[i].len = len;
+	}
+}
+
+/* RFC1123 date, as specified in RFC2616, formatted once per second */
+static char *date(size_t *len)
+{
+	static char   buf[42];
+	static size_t buf_len;
+	static time_t then;
+	time_t now;
+
+	now = time(NULL);
+	if (now != then || !buf_len) {
+		buf_len = strftime(buf, sizeof(buf), "%a, %d %b %Y %T %Z", gmtime(&now));
+		then = now;
+	}
+	*len = buf_len;
+
+	return buf;
+}
+
+/*
+ * Fill in iov with the reply to an M-SEARCH for type, one of the
+ * supported_types[] except SSDP_ST_ALL.  Returns the number of segments,
+ * REPLY_IOV, or 0 if there is nothing to reply with.
+ */
+int compose_reply(struct ifsock *ifs, char *type, struct iovec *iov)
+{
+	size_t i;
+
+	for (i = 0; supported_types[i]; i++) {
+		if (!strcmp(supported_types[i], type))
+			break;
+	}
+	if (!supported_types[i] || !strcmp(type, SSDP_ST_ALL))
+		return 0;
+
+	if (!ifs->location_len) {
+		char host[NI_MAXHOST + 2];
+		int len;
+
+		if (compose_host(ifs, host, sizeof(host)))
+			return 0;
+
+		len = snprintf(ifs->location, sizeof(ifs->location), "\r\n"
+			       "Location: http://%s:%d%s\r\n",
+			       host, LOCATION_PORT, LOCATION_DESC);
+		if (len < 0 || (size_t)len >= sizeof(ifs->location))
+			return 0;
+		ifs->location_len = len;
+	}
+
+	segments();
+	if (!types[i].len)
+		return 0;
+
+	iov[0].iov_base = head.buf;
+	iov[0].iov_len  = head.len;
+	iov[1].iov_base = date(&iov[1].iov_len);
+	iov[2].iov_base = ifs->location;
+	iov[2].iov_len  = ifs->location_len;
+	iov[3].iov_base = types[i].buf;
+	iov[3].iov_len  = types[i].len;
+
+	return REPLY_IOV;
+}
+
+void compose_search(char *type, char *buf, size_t len)
+{
+	snprintf(buf, len, "M-SEARCH * HTTP/1.1\r\n"
+		 "Host: %s:%d\r\n"
+		 "MAN: \"ssdp:discover\"\r\n"
+		 "MX: 1\r\n"
+		 "ST: %s\r\n"
+		 "User-Agent: %s\r\n"
+		 "\r\n",
+		 MC_SSDP_GROUP, MC_SSDP_PORT,
+		 type,
+		 server_string);
+}
+
+void compose_notify(char *type, char *host, char *buf, size_t len)
+{
+	char usn[256];
+
+	if (type) {
+		if (!strcmp(type, SSDP_ST_ALL))
+			type = NULL;
+		else
+			snprintf(usn, sizeof(usn), "%s::%s", uuid, type);
+	}
+
+	if (!type) {
+		type = usn;
+		strncpy(usn, uuid, sizeof(usn));
+	}
+
+	snprintf(buf, len, "NOTIFY * HTTP/1.1\r\n"
+		 "Host: %s:%d\r\n"
+		 "Server: %s\r\n"
+		 "Location: http://%s:%d%s\r\n"
+		 "NT: %s\r\n"
+		 "NTS: ssdp:alive\r\n"
+		 "USN: %s\r\n"
+		 "Cache-Control: max-age=%d\r\n"
+		 "\r\n",
+		 MC_SSDP_GROUP, MC_SSDP_PORT,
+		 server_string,
+		 host, LOCATION_PORT, LOCATION_DESC,
+		 type,
+		 usn,
+		 CACHE_TIMEOUT);
+}
+
+void compose_byebye(char *type, char *buf, size_t len)
+{
+	snprintf(buf, len, "NOTIFY * HTTP/1.1\r\n"
+		 "Host: %s:%d\r\n"
+		 "NT: %s\r\n"
+		 "NTS: ssdp:byebye\r\n"
+		 "USN: %s::%s\r\n"
+		 "\r\n",
+		 MC_SSDP_GROUP, MC_SSDP_PORT,
+		 type,
+		 uuid, type);
+}
+
+/*
+ * Classify an SSDP message.  For M-SEARCH the ST is NUL terminated in
+ * place and returned in type, or SSDP_ST_ALL when missing.  A malformed
+ * ST header yields SSDP_MSEARCH with type set to NULL.
+ */
+int ssdp_parse(char *buf, char **type)
+{
+	char *ptr;
+
+	*type = NULL;
+	if (!strncmp(buf, "NOTIFY *", 8))
+		return SSDP_NOTIFY;
+	if (!strncasecmp(buf, "HTTP/1.1 200", 12))
+		return SSDP_RESPONSE;
+	if (!strstr(buf, "M-SEARCH *"))
+		return SSDP_UNKNOWN;
+
+	ptr = strcasestr(buf, "\r\nST:");
+	if (!ptr) {
+		*type = SSDP_ST_ALL;
+		return SSDP_MSEARCH;
+	}
+
+	ptr = strchr(ptr, ':');
+	if (!ptr)
+		return SSDP_MSEARCH;
+	ptr++;
+	while (isspace(*ptr))
+		ptr++;
+
+	*type = ptr;
+	ptr = strstr(ptr, "\r\n");
+	if (!ptr) {
+		*type = NULL;
+		return SSDP_MSEARCH;
+	}
+	*ptr = 0;
+
+	return SSDP_MSEARCH;
+}
+
+/* Returns 1 if we answer M-SEARCH for type */
+int ssdp_supported(char *type)
+{
+	size_t i;
+
+	for (i = 0; supported_types[i]; i++) {
+		if (!strcmp(supported_types[i], type))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Control message buffer for the source address, see compose_msg() */
+union pktinfo {
+	char buf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+	struct cmsghdr align;
+};
+
+/* Send, when the send buffer is full grow it and try again, once */
+static ssize_t send_grow(int sd, struct msghdr *msg)
+{
+	ssize_t num;
+	int err;
+
+	num = ssdp_sendmsg(sd, msg, 0);
+	if (num < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)) {
+		err = errno;
+		if (socket_grow(sd, SO_SNDBUF)) {
+			errno = err;
+			return num;
+		}
+		num = ssdp_sendmsg(sd, msg, 0);
+	}
+
+	return num;
+}
+
+/*
+ * Same for a batch, what is left after a full send buffer is retried
+ * once it has grown.  Returns the number of datagrams sent, or -1 with
+ * errno set if none were.
+ */
+static int sendmm_grow(int sd, struct mmsghdr *vec, unsigned int num)
+{
+	int sent, more, err;
+
+	sent = ssdp_sendmmsg(sd, vec, num, 0);
+	if (sent < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)
+			return -1;
+		sent = 0;
+	}
+	if ((unsigned int)sent == num)
+		return sent;
+
+	err = errno;
+	if (!socket_grow(sd, SO_SNDBUF)) {
+		more = ssdp_sendmmsg(sd, &vec[sent], num - sent, 0);
+		if (more > 0)
+			sent += more;
+		else
+			err = errno;
+	}
+	if (!sent) {
+		errno = err;
+		return -1;
+	}
+
+	return sent;
+}
+
+/*
+ * Set up msg to send the cnt segments in iov, as one datagram, to sa on
+ * the outbound socket of ifs.  A shared socket is not bound to the
+ * interface, so the source address and interface are given in ctl, as
+ * IP_PKTINFO/IPV6_PKTINFO, with each packet.
+ */
+static void compose_msg(struct ifsock *ifs, struct msghdr *msg, union pktinfo *ctl,
+			struct iovec *iov, size_t cnt, struct sockaddr *sa)
+{
+	struct cmsghdr *cmsg;
+
+	memset(msg, 0, sizeof(*msg));
+	msg->msg_name    = sa;
+	msg->msg_namelen = sa->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+	msg->msg_iov     = iov;
+	msg->msg_iovlen  = cnt;
+
+	if (!ifs->ifindex)
+		return;
+
+	memset(ctl, 0, sizeof(*ctl));
+	msg->msg_control = ctl->buf;
+	if (ifs->addr.ss_family == AF_INET) {
+		struct in_pktinfo *pi;
+
+		msg->msg_controllen = CMSG_SPACE(sizeof(*pi));
+		cmsg = CMSG_FIRSTHDR(msg);
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type  = IP_PKTINFO;
+		cmsg->cmsg_len   = CMSG_LEN(sizeof(*pi));
+
+		pi = (struct in_pktinfo *)CMSG_DATA(cmsg);
+		pi->ipi_ifindex  = ifs->ifindex;
+		pi->ipi_spec_dst = ((struct sockaddr_in *)&ifs->addr)->sin_addr;
+	} else {
+		struct in6_pktinfo *pi6;
+
+		msg->msg_controllen = CMSG_SPACE(sizeof(*pi6));
+		cmsg = CMSG_FIRSTHDR(msg);
+		cmsg->cmsg_level = IPPROTO_IPV6;
+		cmsg->cmsg_type  = IPV6_PKTINFO;
+		cmsg->cmsg_len   = CMSG_LEN(sizeof(*pi6));
+
+		pi6 = (struct in6_pktinfo *)CMSG_DATA(cmsg);
+		pi6->ipi6_ifindex = ifs->ifindex;
+		pi6->ipi6_addr    = ((struct sockaddr_in6 *)&ifs->addr)->sin6_addr;
+	}
+}
+
+ssize_t ssdp_sendv(struct ifsock *ifs, struct iovec *iov, size_t cnt, struct sockaddr *sa)
+{
+	union pktinfo ctl;
+	struct msghdr msg;
+
+	compose_msg(ifs, &msg, &ctl, iov, cnt, sa);
+
+	return send_grow(ifs->out, &msg);
+}
+
+ssize_t ssdp_send(struct ifsock *ifs, char *buf, size_t len, struct sockaddr *sa)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+	return ssdp_sendv(ifs, &iov, 1, sa);
+}
+
+void send_search(struct ifsock *ifs, char *type)
+{
+	ssize_t num;
+	char buf[MAX_PKT_SIZE];
+	struct sockaddr_storage dest;
+
+	memset(buf, 0, sizeof(buf));
+	compose_search(type, buf, sizeof(buf));
+
+	if (ifs->addr.ss_family == AF_INET)
+		compose_addr((struct sockaddr_in *)&dest, MC_SSDP_GROUP, MC_SSDP_PORT);
+	else if (ifs->addr.ss_family == AF_INET6)
+		compose_addr6((struct sockaddr_in6 *)&dest, MC_SSDP_GROUP_IPV6, MC_SSDP_PORT);
+
+	logit(LOG_DEBUG, "Sending M-SEARCH ...");
+	num = ssdp_send(ifs, buf, strlen(buf), (struct sockaddr *)&dest);
+	if (num < 0) {
+		logit(LOG_WARNING, "Failed sending SSDP M-SEARCH");
+		ifs->stats.send_err++;
+		return;
+	}
+
+	ifs->stats.tx_pkts++;
+	ifs->stats.tx_bytes += num;
+}
+
+/*
+ * Tell control points type is gone, when it is replaced by another
+ * device type, rather than have them keep it until max-age runs out.
+ */
+void send_byebye(struct ifsock *ifs, char *type)
+{
+	ssize_t num;
+	char buf[SEND_PKT_SIZE];
+	struct sockaddr_storage dest;
+
+	if (ifs->out == -1)
+		return;
+
+	memset(buf, 0, sizeof(buf));
+	compose_byebye(type, buf, sizeof(buf));
+
+	if (ifs->addr.ss_family == AF_INET)
+		compose_addr((struct sockaddr_in *)&dest, MC_SSDP_GROUP, MC_SSDP_PORT);
+	else if (ifs->addr.ss_family == AF_INET6)
+		compose_addr6((struct sockaddr_in6 *)&dest, MC_SSDP_GROUP_IPV6, MC_SSDP_PORT);
+
+	logit(LOG_DEBUG, "Sending byebye for %s from %s ...", type, ifs->ifname);
+	num = ssdp_send(ifs, buf, strlen(buf), (struct sockaddr *)&dest);
+	if (num < 0) {
+		logit(LOG_WARNING, "Failed sending SSDP byebye, type: %s: %s", type, strerror(errno));
+		ifs->stats.send_err++;
+		return;
+	}
+
+	ifs->stats.tx_pkts++;
+	ifs->stats.tx_bytes += num;
+}
+
+/*
+ * Time from M-SEARCH received, rx, to reply sent.  The histograms are
+ * allocated on the first reply, most interfaces never get one.
+ */
+static void latency(struct ifsock *ifs, char *type, struct timespec *rx)
+{
+	struct ifstats *st = &ifs->stats;
+	struct timespec now;
+	int64_t diff;
+	uint64_t usec;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	diff = (int64_t)(now.tv_sec - rx->tv_sec) * 1000000 + (now.tv_nsec - rx->tv_nsec) / 1000;
+	usec = diff > 0 ? diff : 0;
+
+	if (!st->lat_num || usec < st->lat_min)
+		st->lat_min = usec;
+	if (usec > st->lat_max)
+		st->lat_max = usec;
+	st->lat_sum += usec;
+	st->lat_num++;
+
+	if (!ifs->lat && (ifs->lat = calloc(1, sizeof(*ifs->lat))))
+		hist_num++;
+	if (ifs->lat)
+		hist_add(ifs->lat, usec);
+
+	for (i = 0; i < SSDP_TYPES; i++) {
+		if (!strcmp(supported_types[i], type)) {
+			hist_add(&st_lat[i], usec);
+			break;
+		}
+	}
+}
+
+/*
+ * Host part of the Location URL for the address of ifs, IPv6 link-local
+ * in brackets without scope.  Returns -1 for the wildcard address.
+ */
+int compose_host(struct ifsock *ifs, char *host, size_t len)
+{
+	char *pos;
+	int s;
+
+	if (ifs->addr.ss_family == AF_INET) {
+		const struct sockaddr_in *addr = (struct sockaddr_in *) &ifs->addr;
+		if (addr->sin_addr.s_addr == htonl(INADDR_ANY))
+			return -1;
+	}
+	else if (ifs->addr.ss_family == AF_INET6) {
+		const struct sockaddr_in6 *addr = (struct sockaddr_in6 *) &ifs->addr;
+		if (memcmp(&addr->sin6_addr, &in6addr_any, sizeof(struct in6_addr)) == 0)
+			return -1;
+	}
+
+	s = getnameinfo((struct sockaddr *)&ifs->addr, sizeof(struct sockaddr_storage),
+			host, len, NULL, 0, NI_NUMERICHOST);
+	if (s) {
+		logit(LOG_WARNING, "Failed getnameinfo(): %s", gai_strerror(s));
+		return -1;
+	}
+
+	if (ifs->addr.ss_family == AF_INET6) {
+		pos = strchr(host, '%');
+		if (pos) {
+			char host6[NI_MAXHOST + 2];
+
+			*pos = '\0';
+			snprintf(host6, sizeof(host6), "[%s]", host);
+			strncpy(host, host6, len - 1);
+			host[len - 1] = 0;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Reply to an M-SEARCH for ssdp:all with one response per supported
+ * type, as UDA requires, all in one sendmmsg().  The responses are
+ * built from the same prebuilt segments as a single reply, and share
+ * the packet info, which is the same for all of them.
+ */
+static void send_all(struct ifsock *ifs, struct sockaddr *sa, struct timespec *rx)
+{
+	struct iovec iov[SSDP_TYPES][REPLY_IOV];
+	struct mmsghdr vec[SSDP_TYPES];
+	char *type[SSDP_TYPES];
+	union pktinfo ctl;
+	int i, num = 0, sent;
+
+	for (i = 0; supported_types[i]; i++) {
+		int cnt;
+
+		/* Zero for SSDP_ST_ALL itself */
+		cnt = compose_reply(ifs, supported_types[i], iov[num]);
+		if (!cnt)
+			continue;
+
+		compose_msg(ifs, &vec[num].msg_hdr, &ctl, iov[num], cnt, sa);
+		vec[num].msg_len = 0;
+		type[num++] = supported_types[i];
+	}
+	if (!num)
+		return;
+
+	logit(LOG_DEBUG, "Sending %d replies from %s ...", num, ifs->ifname);
+	sent = sendmm_grow(ifs->out, vec, num);
+	if (sent < num) {
+		logit(LOG_WARNING, "Failed sending SSDP reply, type: %s: %s",
+		      type[sent < 0 ? 0 : sent], strerror(errno));
+		ifs->stats.send_err++;
+	}
+
+	for (i = 0; i < sent; i++) {
+		ifs->stats.tx_pkts++;
+		ifs->stats.tx_bytes += vec[i].msg_len;
+		ifs->stats.replies++;
+		TRACE3(reply, ifs->ifname, type[i], vec[i].msg_len);
+	}
+	if (sent > 0 && rx)
+		latency(ifs, SSDP_ST_ALL, rx);
+}
+
+static int is_upstream(const char *ifname)
+{
+	int i;
+
+	for (i = 0; i < upnum; i++) {
+		if (!strcmp(upstream[i], ifname))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Reply for a neighbor, with its own Location, Server and USN, and the
+ * max-age it has left.  Returns the length, or 0 if it cannot be used.
+ */
+static size_t compose_proxy(struct neighbor *n, uint64_t now, char *buf, size_t len)
+{
+	size_t date_len;
+	char *when;
+	int num;
+
+	if (!n->location[0] || n->expiry.expires <= now)
+		return 0;
+
+	when = date(&date_len);
+	num = snprintf(buf, len, "HTTP/1.1 200 OK\r\n"
+		       "Server: %s\r\n"
+		       "Date: %.*s\r\n"
+		       "Location: %s\r\n"
+		       "ST: %s\r\n"
+		       "EXT: \r\n"
+		       "USN: %s\r\n"
+		       "Cache-Control: max-age=%d\r\n"
+		       "\r\n",
+		       n->server,
+		       (int)date_len, when,
+		       n->location,
+		       n->nt,
+		       n->usn,
+		       (int)((n->expiry.expires - now + 999) / 1000));
+	if (num < 0 || (size_t)num >= len)
+		return 0;
+
+	return num;
+}
+
+static int send_batch(struct ifsock *ifs, struct mmsghdr *vec, int num)
+{
+	int i, sent;
+
+	sent = sendmm_grow(ifs->out, vec, num);
+	if (sent < num) {
+		logit(LOG_WARNING, "Failed sending SSDP proxy reply from %s: %s",
+		      ifs->ifname, strerror(errno));
+		ifs->stats.send_err++;
+	}
+
+	for (i = 0; i < sent; i++) {
+		ifs->stats.tx_pkts++;
+		ifs->stats.tx_bytes += vec[i].msg_len;
+		stats.proxied++;
+	}
+
+	return sent > 0 ? sent : 0;
+}
+
+/*
+ * Proxy mode, answer an M-SEARCH received on a downstream interface for
+ * the neighbors learned on the upstream ones, in batches of PROXY_BATCH
+ * per sendmmsg().  Returns the number of replies sent.
+ */
+static int send_proxy(struct ifsock *ifs, char *type, struct sockaddr *sa)
+{
+	char buf[PROXY_BATCH][PROXY_PKT_SIZE];
+	struct iovec iov[PROXY_BATCH];
+	struct mmsghdr vec[PROXY_BATCH];
+	struct neighbor *n;
+	union pktinfo ctl;
+	uint64_t now;
+	int all, num = 0, total = 0;
+
+	if (!upnum || ifs->out == -1 || is_upstream(ifs->ifname))
+		return 0;
+
+	all = !strcmp(type, SSDP_ST_ALL);
+	now = timer_now();
+	for (n = cache_first(); n; n = cache_next(n)) {
+		if (!all && strcmp(n->nt, type))
+			continue;
+		if (!is_upstream(n->ifname))
+			continue;
+
+		iov[num].iov_base = buf[num];
+		iov[num].iov_len  = compose_proxy(n, now, buf[num], sizeof(buf[num]));
+		if (!iov[num].iov_len)
+			continue;
+
+		compose_msg(ifs, &vec[num].msg_hdr, &ctl, &iov[num], 1, sa);
+		vec[num].msg_len = 0;
+		if (++num == PROXY_BATCH) {
+			total += send_batch(ifs, vec, num);
+			num = 0;
+		}
+	}
+	if (num)
+		total += send_batch(ifs, vec, num);
+
+	return total;
+}
+
+void send_message(struct ifsock *ifs, char *type, struct sockaddr *sa, struct timespec *rx)
+{
+	size_t note = 0;
+	ssize_t num;
+	char host[NI_MAXHOST + 2];
+	char buf[SEND_PKT_SIZE];
+	struct iovec iov[REPLY_IOV];
+	size_t cnt = 0;
+	struct sockaddr_storage dest;
+
+	if (ifs->out == -1)
+		return;
+
+	if (sa && !strcmp(type, SSDP_ST_ALL)) {
+		send_all(ifs, sa, rx);
+		return;
+	}
+
+	/* Common case, M-SEARCH for one type, from prebuilt segments */
+	if (sa)
+		cnt = compose_reply(ifs, type, iov);
+
+	if (!cnt) {
+		if (compose_host(ifs, host, sizeof(host)))
+			return;
+
+		memset(buf, 0, sizeof(buf));
+		if (sa)
+			compose_response(type, host, buf, sizeof(buf));
+		else
+			compose_notify(type, host, buf, sizeof(buf));
+
+		iov[0].iov_base = buf;
+		iov[0].iov_len  = strlen(buf);
+		cnt = 1;
+	}
+
+	if (!sa) {
+		note = 1;
+		if (ifs->addr.ss_family == AF_INET)
+			compose_addr((struct sockaddr_in *)&dest, MC_SSDP_GROUP, MC_SSDP_PORT);
+		else if (ifs->addr.ss_family == AF_INET6)
+			compose_addr6((struct sockaddr_in6 *)&dest, MC_SSDP_GROUP_IPV6, MC_SSDP_PORT);
+		sa = (struct sockaddr *) &dest;
+	}
+
+	logit(LOG_DEBUG, "Sending %s from %s ...", !note ? "reply" : "notify", ifs->ifname);
+	num = ssdp_sendv(ifs, iov, cnt, sa);
+	if (num < 0) {
+		logit(LOG_WARNING, "Failed sending SSDP %s, type: %s: %s", !note ? "reply" : "notify", type, strerror(errno));
+		ifs->stats.send_err++;
+		return;
+	}
+
+	ifs->stats.tx_pkts++;
+	ifs->stats.tx_bytes += num;
+	if (note) {
+		TRACE3(notify, ifs->ifname, type, num);
+		ifs->stats.notify++;
+	} else {
+		TRACE3(reply, ifs->ifname, type, num);
+		ifs->stats.replies++;
+	}
+	if (rx)
+		latency(ifs, type, rx);
+}
+
+/*
+ * Process one received SSDP message from sa, NUL terminated in buf, that
+ * arrived on interface ifindex, or 0 if not known.  The rx timestamp is
+ * when it was received, for latency statistics.
+ */
+void ssdp_input(char *buf, size_t len, struct sockaddr *sa, int ifindex, struct timespec *rx)
+{
+	struct ifsock *ifs = NULL;
+	char *type;
+	int kind, supported;
+
+	if (sa->sa_family != AF_INET && sa->sa_family != AF_INET6)
+		return;
+	ifs = find_ingress(sa, ifindex);
+
+	TRACE2(match, ifs ? ifs->ifname : NULL, ifs ? ifs->addr.ss_family : 0);
+	if (ifs) {
+		ifs->stats.rx_pkts++;
+		ifs->stats.rx_bytes += len;
+	}
+
+	/* Neighbor announcements and replies to our M-SEARCH */
+	kind = ssdp_parse(buf, &type);
+	if (kind == SSDP_NOTIFY) {
+		TRACE2(parse, "NOTIFY", NULL);
+		cache_notify(buf, sa, ifs ? ifs->ifname : NULL);
+		return;
+	}
+	if (kind == SSDP_RESPONSE) {
+		TRACE2(parse, "HTTP", NULL);
+		cache_response(buf, sa, ifs ? ifs->ifname : NULL);
+		return;
+	}
+
+	if (kind == SSDP_MSEARCH) {
+		/* Client address only needed for debug messages */
+		char addr[INET6_ADDRSTRLEN] = "";
+		int port = -1;
+		if (log_enabled(LOG_DEBUG)) {
+			if (sa->sa_family == AF_INET) {
+				struct sockaddr_in *sin = (struct sockaddr_in *)sa;
+
+				inet_ntop(AF_INET, &sin->sin_addr, addr, INET_ADDRSTRLEN);
+				port = ntohs(sin->sin_port);
+			}
+			else if (sa->sa_family == AF_INET6) {
+				struct sockaddr_in6 *sin = (struct sockaddr_in6 *)sa;
+
+				inet_ntop(AF_INET6, &sin->sin6_addr, addr, INET6_ADDRSTRLEN);
+				port = ntohs(sin->sin6_port);
+			}
+		}
+
+		if (!ifs) {
+			logit(LOG_DEBUG, "No matching socket for client %s", addr);
+			stats.no_iface++;
+			return;
+		}
+		logit(LOG_DEBUG, "Matching socket for client %s", addr);
+		ifs->stats.msearch++;
+
+		if (!type)
+			return;
+		TRACE2(parse, "M-SEARCH", type);
+
+		supported = ssdp_supported(type);
+		if (supported) {
+			logit(LOG_DEBUG, "M-SEARCH * ST: %s from %s port %d", type,
+			      addr, port);
+			send_message(ifs, type, sa, rx);
+		}
+
+		/* Proxy mode, devices on the upstream interfaces */
+		if (send_proxy(ifs, type, sa) || supported)
+			return;
+
+		logit(LOG_DEBUG, "M-SEARCH * for unsupported ST: %s from %s", type, addr);
+		ifs->stats.unsupported++;
+	}
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
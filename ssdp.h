@@ -17,23 +17,91 @@
 #ifndef SSDP_H_
 #define SSDP_H_
 
+#include <paths.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <syslog.h>
+#include <time.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "queue.h"
 
 /* Notify should be less than half the cache timeout */
 #define NOTIFY_INTERVAL      300
+#define NOTIFY_JITTER        100	/* msec, first NOTIFY on new iface */
+#define NOTIFY_PPS           100
+#define NOTIFY_PPS_MAX       1000000
+#define BUFFER_MAX           1024	/* KiB, socket buffers grow up to */
 #define REFRESH_INTERVAL     600
 #define CACHE_TIMEOUT        1800
-#define MAX_NUM_IFACES       100
+#define CACHE_MAX_NEIGHBORS  256
 #define MAX_PKT_SIZE         512
+/* NOTIFY and M-SEARCH reply, fixed text, address, identity and the device type twice */
+#define SEND_PKT_SIZE        (256 + INET6_ADDRSTRLEN + sizeof(server_string) + sizeof(uuid) + 2 * sizeof(device_type))
 #define MC_SSDP_GROUP        "239.255.255.250"
 #define MC_SSDP_GROUP_IPV6   "FF02::C"
 #define MC_SSDP_PORT         1900
 #define LOCATION_PORT        (MC_SSDP_PORT + 1)
 #define LOCATION_DESC        "/description.xml"
+#define LOCATION_METRICS     "/metrics"
+#define CTL_SOCKET           _PATH_VARRUN PACKAGE_NAME ".sock"
+#define CTL_MODE             0660
+#define SNAP_FILE            _PATH_VARDB PACKAGE_NAME ".state"
+#define SHM_FILE             _PATH_VARRUN PACKAGE_NAME ".stats"
+#define SHM_INTERVAL         1000	/* msec, stats segment update */
 
 #define SSDP_ST_ALL          "ssdp:all"
+#define SSDP_TYPES           4		/* Entries in supported_types[] */
+
+#define NEIGH_USN_LEN        256
+#define NEIGH_NT_LEN         256
+#define NEIGH_LOCATION_LEN   256
+#define NEIGH_SERVER_LEN     128
+
+#define UPSTREAM_MAX         8		/* Proxy mode upstream interfaces */
+#define PROXY_PKT_SIZE       1024	/* Reply for a neighbor, headers as it sent them */
+#define PROXY_BATCH          16		/* Replies per sendmmsg() */
+
+#define CONN_MAX             16		/* ssdpctl and HTTP clients at a time */
+#define CONN_TIMEOUT         2000	/* msec, for request and reply, in total */
+#define CONN_REQ_LEN         1024
 
-#define logit(lvl, fmt, args...) syslog(lvl, fmt, ##args)
+#define IFS_SLAB             64		/* Interface table entries per slab */
+#define REPLY_IOV            4		/* Segments in an M-SEARCH reply */
+#define REPLY_LOCATION_LEN   128
+
+#define HIST_BUCKETS         92		/* Latency, 0 usec to 14.7 sec and above */
+
+/* Arguments are not evaluated unless lvl is enabled in the log mask */
+#define log_enabled(lvl) (log_mask & LOG_MASK(lvl))
+#define logit(lvl, fmt, args...)					\
+	do {								\
+		if (log_enabled(lvl))					\
+			log_write(lvl, fmt, ##args);			\
+	} while (0)
+
+/*
+ * USDT static tracepoints, provider ssdpd, for bpftrace/perf/systemtap.
+ * Compiled out unless configured with --enable-usdt, and even then only
+ * a single nop on the hot path until a tracer attaches.
+ */
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+#define TRACE(name)                     DTRACE_PROBE(ssdpd, name)
+#define TRACE1(name, a)                 DTRACE_PROBE1(ssdpd, name, a)
+#define TRACE2(name, a, b)              DTRACE_PROBE2(ssdpd, name, a, b)
+#define TRACE3(name, a, b, c)           DTRACE_PROBE3(ssdpd, name, a, b, c)
+#define TRACE4(name, a, b, c, d)        DTRACE_PROBE4(ssdpd, name, a, b, c, d)
+#else
+#define TRACE(name)                     do { } while (0)
+#define TRACE1(name, a)                 do { } while (0)
+#define TRACE2(name, a, b)              do { } while (0)
+#define TRACE3(name, a, b, c)           do { } while (0)
+#define TRACE4(name, a, b, c, d)        do { } while (0)
+#endif
 
 #define SET_SOCKOPT(sd, level, opt, v)					\
         do {								\
@@ -44,10 +112,325 @@
 #define ENABLE_SOCKOPT(sd, level, opt)	SET_SOCKOPT(sd, level, opt, 1)
 #define DISABLE_SOCKOPT(sd, level, opt)	SET_SOCKOPT(sd, level, opt, 0)
 
+/* One-shot timer, msec CLOCK_MONOTONIC, see timer.c */
+struct timer {
+	LIST_ENTRY(timer) link;
+	uint64_t expires;
+	void   (*cb)(void *arg, uint64_t now);
+	void    *arg;
+	uint8_t  level, slot;
+	int      pending;
+};
+
+/* Per-interface counters, plain integers bumped on the hot path */
+struct ifstats {
+	uint64_t rx_pkts, rx_bytes;
+	uint64_t tx_pkts, tx_bytes;
+
+	uint64_t msearch;		/* M-SEARCH * received */
+	uint64_t unsupported;		/* ... for an ST we do not serve */
+	uint64_t replies;		/* M-SEARCH * replies sent */
+	uint64_t notify;		/* NOTIFY * sent */
+	uint64_t send_err;		/* Failed sendto() */
+
+	/* M-SEARCH received to reply sent, in usec */
+	uint64_t lat_num, lat_sum;
+	uint64_t lat_min, lat_max;
+};
+
+/* Log-linear histogram of latencies in usec, see hist.c */
+struct hist {
+	uint64_t num, sum;
+	uint32_t count[HIST_BUCKETS];
+};
+
+/* Counters not tied to any interface */
+struct stats {
+	uint64_t no_iface;		/* M-SEARCH * from client not on any of our subnets */
+	uint64_t events;		/* Readable sockets handled */
+	uint64_t empty_reads;		/* ... with nothing to read */
+	uint64_t rx_drops;		/* Datagrams lost, receive queue full */
+	uint64_t proxied;		/* M-SEARCH * replies for neighbors, proxy mode */
+	uint64_t http_ok;
+	uint64_t http_bad_request;
+	uint64_t http_forbidden;
+	uint64_t http_not_found;
+};
+
+/*
+ * Stats segment, SHM_FILE, updated every SHM_INTERVAL for readers that
+ * must not disturb the daemon, see shm.c.  It is a seqlock, seq is odd
+ * while an update is in progress, a reader copies the segment and tries
+ * again if seq was odd or has changed since.
+ */
+#define SHM_MAGIC            0x53535453	/* "SSTS" */
+#define SHM_VERSION          1
+#define SHM_ST_LEN           128
+
+struct shm_stats {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t types;			/* SSDP_TYPES */
+	uint32_t size;			/* Of this struct */
+	uint32_t pid;
+	uint32_t seq;
+	uint32_t filtered;		/* Filter counters below are valid */
+
+	int64_t  updated;		/* time(), of last update */
+	uint64_t ifaces;		/* Interface table entries */
+	uint64_t iface_bytes;		/* ... and the memory they use */
+	uint64_t neighbors;
+	uint64_t filter_pass, filter_drop;
+
+	struct stats   stats;
+	struct ifstats total;		/* All interfaces */
+
+	char        st[SSDP_TYPES][SHM_ST_LEN];
+	struct hist lat[SSDP_TYPES];	/* Reply latency, per st[] */
+};
+
+struct ifsock {
+	LIST_ENTRY(ifsock) link;	/* Free list, while unused */
+	size_t key;			/* Index in ift.key[] */
+
+	int stale;
+	int mod;
+
+	/*
+	 * Sockets for inbound and outbound
+	 *
+	 * - The inbound is the multicast socket, shared between all ifaces
+	 * - The outbound is bound to the iface address and a random port,
+	 *   or with -s shared per address family, then ifindex is set and
+	 *   the source is selected per packet with IP_PKTINFO
+	 */
+	int in, out;
+	int ifindex;
+
+	/* Next NOTIFY, not pending until first scheduled */
+	struct timer notify;
+
+	/* Interface name, address and netmask */
+	char ifname[IF_NAMESIZE];
+	struct sockaddr_storage addr;
+	struct sockaddr_in mask;
+
+	/* Location header of M-SEARCH replies, rendered on first use */
+	char   location[REPLY_LOCATION_LEN];
+	size_t location_len;
+
+	struct ifstats stats;
+	struct hist   *lat;		/* Reply latency, from first reply */
+
+	void (*cb)(int);
+};
+
+/* Stream client, see conn.c */
+struct conn {
+	LIST_ENTRY(conn) link;
+	int    sd;
+	struct timer deadline;
+
+	char   req[CONN_REQ_LEN];	/* Request so far, NUL terminated */
+	size_t req_len;
+
+	int    done;			/* Reply queued, or nothing to reply */
+	char  *buf;			/* Reply, sent from off */
+	size_t len, off;
+
+	int  (*input)(struct conn *c);	/* Returns > 0 for more of the request */
+	void  *arg;
+	size_t state;			/* For input(), zero at first */
+};
+
+struct neighbor {
+	LIST_ENTRY(neighbor) hlink;	/* Hash bucket, keyed by USN */
+	TAILQ_ENTRY(neighbor) lru;	/* Oldest update first, for eviction */
+
+	unsigned int hash;
+	struct timer expiry;		/* When max-age runs out */
+
+	char ifname[IF_NAMESIZE];
+	struct sockaddr_storage from;
+
+	char usn[NEIGH_USN_LEN];
+	char nt[NEIGH_NT_LEN];
+	char location[NEIGH_LOCATION_LEN];
+	char server[NEIGH_SERVER_LEN];
+};
+
+/* Settings that can be changed at runtime, see conf.c */
+struct conf {
+	int    interval;
+	int    refresh;
+	int    pps;
+	int    bufmax;
+
+	char **ifaces;
+	size_t ifnum;
+	int    ifalloc;			/* ifaces read from file, not argv */
+
+	char   device_type[128];
+	char   friendly_name[64];
+	char   manufacturer[64];
+	char   manufacturer_url[128];
+	char   model[64];
+
+	char   upstream[UPSTREAM_MAX][IF_NAMESIZE];
+	int    upnum;
+};
+
+/*
+ * Interface table.  The fields searched for every packet are packed in
+ * a dense array of keys, newest last, two to a cache line.  The rest of
+ * each entry is in slabs of IFS_SLAB entries, recycled through a free
+ * list and never moved, so struct ifsock pointers stay valid.
+ */
+struct ifkey {
+	sa_family_t    family;		/* Zero for a removed entry */
+	in_addr_t      mask;		/* IPv4 only */
+	union {
+		in_addr_t       v4;
+		struct in6_addr v6;
+	} addr;
+	int            ifindex;		/* Interface packets arrive on */
+	int            in, out;
+	struct ifsock *ifs;
+};
+
+struct iftab {
+	struct ifkey *key;
+	size_t        num, max;
+	size_t        holes;		/* Removed, until compact_sockets() */
+};
+
+/* Newest first, it is safe to unregister ifs in the loop */
+#define IFS_FOREACH(ifs)						\
+	for (size_t ifs##_i = ift.num; ifs##_i-- > 0;)			\
+		if (((ifs) = ift.key[ifs##_i].ifs))
+
+#define IFS_NEWEST()         (ift.num ? ift.key[ift.num - 1].ifs : NULL)
+
+/* Message kinds, from ssdp_parse() */
+enum {
+	SSDP_UNKNOWN = 0,
+	SSDP_MSEARCH,
+	SSDP_NOTIFY,
+	SSDP_RESPONSE,
+};
+
 extern int debug;
-extern char uuid[];
+extern int log_mask;
+extern char uuid[42];
+extern char server_string[64];
+extern char *supported_types[SSDP_TYPES + 1];
+extern char device_type[128];
+extern char friendly_name[64];
+extern char manufacturer[64];
+extern char manufacturer_url[128];
+extern char model[64];
+extern int  bufmax;
+extern char upstream[UPSTREAM_MAX][IF_NAMESIZE];
+extern int  upnum;
+extern ssize_t (*ssdp_sendmsg)(int, const struct msghdr *, int);
+extern int     (*ssdp_sendmmsg)(int, struct mmsghdr *, unsigned int, int);
+extern struct iftab ift;
+extern struct stats stats;
+extern struct hist st_lat[SSDP_TYPES];
+
+void log_init(int level, int opts, int async);
+void log_exit(void);
+void log_write(int level, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
 
 void web_init(void);
-int register_socket(int in, int out, struct sockaddr *addr, struct sockaddr *mask, void (*cb)(int sd));
+int  web_allow(char *net);
+int  web_render(FILE *fp, struct sockaddr *sa);
+void web_recv(int sd);
+
+int register_socket(int in, int out, char *ifname, struct sockaddr *addr, struct sockaddr *mask, void (*cb)(int sd));
+void unregister_socket(struct ifsock *ifs);
+void compact_sockets(void);
+void free_sockets(void);
+size_t socket_memory(void);
+int  dispatch_socket(int sd);
+void socket_dropped(int sd, uint32_t count);
+int  socket_grow(int sd, int opt);
+struct ifsock *find_outbound(struct sockaddr *sa);
+struct ifsock *find_outbound6(struct sockaddr *sa);
+struct ifsock *find_ingress(struct sockaddr *sa, int ifindex);
+struct ifsock *find_iface(struct sockaddr *sa);
+
+void compose_addr(struct sockaddr_in *sin, char *group, int port);
+void compose_addr6(struct sockaddr_in6 *sin, char *group, int port);
+void compose_response(char *type, char *host, char *buf, size_t len);
+void compose_search(char *type, char *buf, size_t len);
+void compose_notify(char *type, char *host, char *buf, size_t len);
+void compose_byebye(char *type, char *buf, size_t len);
+int  compose_reply(struct ifsock *ifs, char *type, struct iovec *iov);
+int  compose_host(struct ifsock *ifs, char *host, size_t len);
+int  ssdp_parse(char *buf, char **type);
+int  ssdp_supported(char *type);
+void ssdp_input(char *buf, size_t len, struct sockaddr *sa, int ifindex, struct timespec *rx);
+ssize_t ssdp_send(struct ifsock *ifs, char *buf, size_t len, struct sockaddr *sa);
+ssize_t ssdp_sendv(struct ifsock *ifs, struct iovec *iov, size_t cnt, struct sockaddr *sa);
+void send_search(struct ifsock *ifs, char *type);
+void send_byebye(struct ifsock *ifs, char *type);
+void send_message(struct ifsock *ifs, char *type, struct sockaddr *sa, struct timespec *rx);
+
+int    cache_init(size_t max);
+void   cache_exit(void);
+void   cache_notify(char *buf, struct sockaddr *sa, char *ifname);
+void   cache_response(char *buf, struct sockaddr *sa, char *ifname);
+size_t cache_count(void);
+size_t cache_size(void);
+struct neighbor *cache_first(void);
+struct neighbor *cache_next(struct neighbor *n);
+
+int      hist_bucket(uint64_t usec);
+uint64_t hist_floor(int idx);
+void     hist_add(struct hist *h, uint64_t usec);
+uint64_t hist_pct(struct hist *h, int permille);
+
+void     timer_init(void);
+uint64_t timer_now(void);
+void     timer_start(struct timer *t, uint64_t expires, void (*cb)(void *, uint64_t), void *arg);
+void     timer_stop(struct timer *t);
+uint64_t timer_next(void);
+void     timer_run(uint64_t now);
+size_t   timer_count(void);
+
+int    ctl_init(char *path);
+int    ctl_adopt(int sd, char *path);
+void   ctl_exit(void);
+
+int    handover(int sd);
+void   handover_done(void);
+
+int    conf_read(char *file, struct conf *conf);
+void   conf_free(struct conf *conf);
+
+int    filter_attach(int sd, int neighbors);
+void   filter_detach(int sd);
+int    filter_count(uint64_t *pass, uint64_t *drop);
+int    filter_dropped(int sd, uint64_t *drop);
+void   filter_exit(void);
+
+int    snap_load(char *file);
+int    snap_announce(void);
+int    snap_announced(struct ifsock *ifs);
+int    snap_save(char *file);
+void   snap_exit(void);
+
+int      conn_add(int sd, int (*input)(struct conn *), void *arg);
+void     conn_reply(struct conn *c, char *buf, size_t len);
+void     conn_close(struct conn *c);
+size_t   conn_poll(struct pollfd *pfd);
+void     conn_event(int sd, short revents);
+size_t   conn_count(void);
+unsigned conn_gen(void);
+void     conn_exit(void);
+
+int    shm_init(char *file);
+void   shm_exit(void);
 
 #endif /* SSDP_H_ */
@@ -0,0 +1,283 @@
+/* Control tool for the SSDP responder
+ *
+ * Copyright (c) 2017  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.a
+ */
+
+#include <config.h>
+#include <err.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "ssdp.h"
+
+static const int pcts[] = { 500, 900, 990, 999 };
+
+static int usage(int code)
+{
+	printf("Usage: ssdpctl [-hjv] [-f FILE] [-s SOCK] [show [interfaces | stats | latency | neighbors] | stats]\n"
+	       "\n"
+	       "    -f FILE   Stats segment, for stats, default %s\n"
+	       "    -h        This help text\n"
+	       "    -j        JSON output\n"
+	       "    -s SOCK   Control socket, default %s\n"
+	       "    -v        Show program version\n"
+	       "\n"
+	       "Bug report address: %-40s\n", SHM_FILE, CTL_SOCKET, PACKAGE_BUGREPORT);
+
+	return code;
+}
+
+/*
+ * Consistent copy of the segment, retried while ssdpd is updating it.
+ * The updates are short, so spin a while before backing off.
+ */
+static int snapshot(struct shm_stats *seg, struct shm_stats *copy)
+{
+	uint32_t seq;
+	int i;
+
+	for (i = 0; i < 1000; i++) {
+		seq = __atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE);
+		if (!(seq & 1)) {
+			memcpy(copy, seg, sizeof(*copy));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&seg->seq, __ATOMIC_RELAXED) == seq)
+				return 0;
+		}
+		if (i > 100)
+			usleep(100);
+	}
+
+	return -1;
+}
+
+static void stats_text(struct shm_stats *s)
+{
+	struct ifstats *t = &s->total;
+	size_t j;
+	int i;
+
+	printf("Updated     %lld sec ago, ssdpd pid %u\n",
+	       (long long)(time(NULL) - s->updated), s->pid);
+	printf("Interfaces  %llu entries, %llu bytes\n",
+	       (unsigned long long)s->ifaces, (unsigned long long)s->iface_bytes);
+	printf("Received    %llu packets, %llu bytes, %llu M-SEARCH, %llu unsupported, %llu no interface\n",
+	       (unsigned long long)t->rx_pkts, (unsigned long long)t->rx_bytes,
+	       (unsigned long long)t->msearch, (unsigned long long)t->unsupported,
+	       (unsigned long long)s->stats.no_iface);
+	printf("Sent        %llu packets, %llu bytes, %llu replies, %llu NOTIFY, %llu errors\n",
+	       (unsigned long long)t->tx_pkts, (unsigned long long)t->tx_bytes,
+	       (unsigned long long)t->replies, (unsigned long long)t->notify,
+	       (unsigned long long)t->send_err);
+	printf("Sockets     %llu events handled, %llu empty reads, %llu datagrams lost\n",
+	       (unsigned long long)s->stats.events, (unsigned long long)s->stats.empty_reads,
+	       (unsigned long long)s->stats.rx_drops);
+	if (s->filtered)
+		printf("Filter      %llu datagrams passed, %llu dropped\n",
+		       (unsigned long long)s->filter_pass, (unsigned long long)s->filter_drop);
+	printf("Neighbors   %llu, %llu proxied replies\n",
+	       (unsigned long long)s->neighbors, (unsigned long long)s->stats.proxied);
+
+	printf("\n%-57s %8s %10s %10s %10s %10s\n", "SEARCH TARGET",
+	       "REPLIES", "P50 usec", "P90 usec", "P99 usec", "P999 usec");
+	for (i = 0; i < SSDP_TYPES; i++) {
+		printf("%-57s %8llu", s->st[i], (unsigned long long)s->lat[i].num);
+		for (j = 0; j < sizeof(pcts) / sizeof(pcts[0]); j++)
+			printf(" %10llu", (unsigned long long)hist_pct(&s->lat[i], pcts[j]));
+		putchar('\n');
+	}
+}
+
+/* The device type is from the config file */
+static void json_string(const char *str)
+{
+	putchar('"');
+	for (; *str; str++) {
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c < 0x20)
+			printf("\\u%04x", c);
+		else
+			putchar(c);
+	}
+	putchar('"');
+}
+
+static void stats_json(struct shm_stats *s)
+{
+	struct ifstats *t = &s->total;
+	size_t j;
+	int i;
+
+	printf("{\n  \"updated\": %lld, \"pid\": %u,\n", (long long)s->updated, s->pid);
+	printf("  \"interface_table\": { \"entries\": %llu, \"bytes\": %llu },\n",
+	       (unsigned long long)s->ifaces, (unsigned long long)s->iface_bytes);
+	printf("  \"total\": { \"rx_pkts\": %llu, \"rx_bytes\": %llu, \"tx_pkts\": %llu, \"tx_bytes\": %llu"
+	       ", \"msearch\": %llu, \"unsupported\": %llu, \"replies\": %llu, \"notify\": %llu"
+	       ", \"errors\": %llu, \"no_iface\": %llu, \"proxied\": %llu },\n",
+	       (unsigned long long)t->rx_pkts, (unsigned long long)t->rx_bytes,
+	       (unsigned long long)t->tx_pkts, (unsigned long long)t->tx_bytes,
+	       (unsigned long long)t->msearch, (unsigned long long)t->unsupported,
+	       (unsigned long long)t->replies, (unsigned long long)t->notify,
+	       (unsigned long long)t->send_err, (unsigned long long)s->stats.no_iface,
+	       (unsigned long long)s->stats.proxied);
+	if (s->filtered)
+		printf("  \"filter\": { \"passed\": %llu, \"dropped\": %llu },\n",
+		       (unsigned long long)s->filter_pass, (unsigned long long)s->filter_drop);
+	printf("  \"sockets\": { \"events\": %llu, \"empty_reads\": %llu, \"lost\": %llu },\n",
+	       (unsigned long long)s->stats.events, (unsigned long long)s->stats.empty_reads,
+	       (unsigned long long)s->stats.rx_drops);
+	printf("  \"neighbors\": %llu,\n", (unsigned long long)s->neighbors);
+
+	printf("  \"search_targets\": [");
+	for (i = 0; i < SSDP_TYPES; i++) {
+		printf("%s\n    { \"st\": ", i ? "," : "");
+		json_string(s->st[i]);
+		printf(", \"replies\": %llu, \"sum_usec\": %llu",
+		       (unsigned long long)s->lat[i].num, (unsigned long long)s->lat[i].sum);
+		for (j = 0; j < sizeof(pcts) / sizeof(pcts[0]); j++)
+			printf(", \"p%d\": %llu", pcts[j] % 10 ? pcts[j] : pcts[j] / 10,
+			       (unsigned long long)hist_pct(&s->lat[i], pcts[j]));
+		printf(" }");
+	}
+	printf("\n  ]\n}\n");
+}
+
+/* Read the stats segment, no request to the daemon */
+static int show_stats(char *file, int json)
+{
+	struct shm_stats *seg, copy;
+	struct stat st;
+	int fd;
+
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		err(1, "Failed opening %s, is ssdpd running?", file);
+	if (fstat(fd, &st))
+		err(1, "Failed reading %s", file);
+	if ((size_t)st.st_size < sizeof(*seg))
+		errx(1, "Invalid stats segment %s", file);
+
+	seg = mmap(NULL, sizeof(*seg), PROT_READ, MAP_SHARED, fd, 0);
+	if (seg == MAP_FAILED)
+		err(1, "Failed mapping %s", file);
+	close(fd);
+
+	if (seg->magic != SHM_MAGIC || seg->version != SHM_VERSION ||
+	    seg->size != sizeof(*seg) || seg->types != SSDP_TYPES)
+		errx(1, "Stats segment %s is from another version of ssdpd", file);
+	if (snapshot(seg, &copy))
+		errx(1, "Stats segment %s is not updated, is ssdpd stuck?", file);
+	munmap(seg, sizeof(*seg));
+
+	if (json)
+		stats_json(&copy);
+	else
+		stats_text(&copy);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char *path = CTL_SOCKET;
+	char *file = SHM_FILE;
+	struct sockaddr_un sun;
+	char buf[BUFSIZ];
+	char cmd[128];
+	int c, i, sd, json = 0;
+	ssize_t len;
+
+	while ((c = getopt(argc, argv, "f:hjs:v")) != EOF) {
+		switch (c) {
+		case 'f':
+			file = optarg;
+			break;
+
+		case 'h':
+			return usage(0);
+
+		case 'j':
+			json = 1;
+			break;
+
+		case 's':
+			path = optarg;
+			break;
+
+		case 'v':
+			puts(PACKAGE_VERSION);
+			return 0;
+
+		default:
+			return usage(1);
+		}
+	}
+
+	if (optind == argc - 1 && !strcmp(argv[optind], "stats"))
+		return show_stats(file, json);
+
+	if (optind < argc) {
+		cmd[0] = 0;
+		for (i = optind; i < argc; i++) {
+			if (i > optind)
+				strncat(cmd, " ", sizeof(cmd) - strlen(cmd) - 1);
+			strncat(cmd, argv[i], sizeof(cmd) - strlen(cmd) - 1);
+		}
+	} else {
+		strcpy(cmd, "show");
+	}
+	if (json)
+		strncat(cmd, " json", sizeof(cmd) - strlen(cmd) - 1);
+	strncat(cmd, "\n", sizeof(cmd) - strlen(cmd) - 1);
+
+	sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sd < 0)
+		err(1, "Failed creating socket");
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+	if (connect(sd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+		err(1, "Failed connecting to %s, is ssdpd running?", path);
+
+	if (write(sd, cmd, strlen(cmd)) < 0)
+		err(1, "Failed sending command");
+
+	while ((len = read(sd, buf, sizeof(buf))) > 0) {
+		if (fwrite(buf, 1, len, stdout) != (size_t)len)
+			err(1, "Failed writing output");
+	}
+	close(sd);
+
+	return len < 0 ? 1 : 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -19,6 +19,7 @@
 #include <ctype.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <ifaddrs.h>
 #include <netdb.h>
@@ -36,154 +37,102 @@
 #include <netinet/udp.h>
 #include <net/if.h>
 #include <sys/param.h>		/* MIN() */
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 
 #include "ssdp.h"
-#include "queue.h"
 
-struct ifsock {
-	LIST_ENTRY(ifsock) link;
+/*
+ * Hot restart, see handover().  Both ends are the same build on the
+ * same host, so records are sent as plain structs, the header carries
+ * the record size as a sanity check.
+ */
+#define HANDOVER_MAGIC       0x53534450	/* "SSDP" */
+#define HANDOVER_VERSION     1
+#define HANDOVER_MAX_FDS     250	/* SCM_MAX_FD is 253 */
+#define HANDOVER_BATCH       64
+#define HANDOVER_TIMEOUT     2		/* sec */
+
+enum {
+	HO_FDS = 1,			/* Only descriptors, in SCM_RIGHTS */
+	HO_IFS,				/* Interface table entries */
+	HO_END,				/* Global state, last */
+};
 
-	int stale;
-	int mod;
+enum {
+	HO_SSDP = 1,
+	HO_WEB,
+	HO_CTL,
+};
 
-	/*
-	 * Sockets for inbound and outbound
-	 *
-	 * - The inbound is the multicast socket, shared between all ifaces
-	 * - The outbound is bound to the iface address and a random port
-	 */
-	int in, out;
+struct ho_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t type;
+	uint32_t num;
+	uint32_t size;			/* Of one record */
+};
 
-	/* Interface address and netmask */
+struct ho_ifs {
+	int32_t  in, out;		/* Index in descriptor table, or -1 */
+	int32_t  kind;
+	int32_t  ifindex;
+	int32_t  mod;
+	uint64_t notify_at;
+
+	char ifname[IF_NAMESIZE];
 	struct sockaddr_storage addr;
 	struct sockaddr_in mask;
 
-	void (*cb)(int);
+	struct ifstats stats;
 };
 
-LIST_HEAD(, ifsock) il = LIST_HEAD_INITIALIZER();
-
-static char *supported_types[] = {
-	SSDP_ST_ALL,
-	"upnp:rootdevice",
-	DEVICE_TYPE,
-	uuid,
-	NULL
+struct ho_end {
+	char     uuid[42];
+	char     server[64];
+	int32_t  shared;
+	int32_t  sd, sd6;		/* Multicast sockets, index */
+	int32_t  shared_sd, shared_sd6;	/* -s sockets, index or -1 */
+	uint32_t members;		/* Last in descriptor table */
 };
 
 int      debug = 0;
 int      running = 1;
+int      neighbors = 0;
+int      shared = 0;
+int      reload = 0;
+int      interval = NOTIFY_INTERVAL;
+int      refresh = REFRESH_INTERVAL;
+int      pps = NOTIFY_PPS;
+int      takeover = 0;
+int      warm = 0;
+int      filter = 0;
 
-char uuid[42];
-char hostname[64];
 char *os = NULL, *ver = NULL;
-char server_string[64] = "POSIX UPnP/1.0 " PACKAGE_NAME "/" PACKAGE_VERSION;
-
-/* Find interface in same subnet as sa */
-static struct ifsock *find_outbound(struct sockaddr *sa)
-{
-	in_addr_t cand;
-	struct ifsock *ifs;
-	struct sockaddr_in *addr = (struct sockaddr_in *)sa;
-
-	cand = addr->sin_addr.s_addr;
-	LIST_FOREACH(ifs, &il, link) {
-		in_addr_t a, m;
-
-		const struct sockaddr_in *addr = (struct sockaddr_in *) &ifs->addr;
-		const struct sockaddr_in *mask = (struct sockaddr_in *) &ifs->mask;
-		a = addr->sin_addr.s_addr;
-		m = mask->sin_addr.s_addr;
-		if (a == htonl(INADDR_ANY) || m == htonl(INADDR_ANY))
-			continue;
-
-		if ((a & m) == (cand & m)) {
-			return ifs;
-		}
-	}
-
-	return NULL;
-}
-
-static struct ifsock *find_outbound6(struct sockaddr *sa)
-{
-	struct in6_addr cand;
-	struct ifsock *ifs;
-	struct sockaddr_in6 *addr = (struct sockaddr_in6 *)sa;
 
-	cand = addr->sin6_addr;
-	LIST_FOREACH(ifs, &il, link) {
-		in_addr_t a, m;
-
-		const struct sockaddr_in6 *addr = (struct sockaddr_in6 *) &ifs->addr;
-
-		if (memcmp(&addr->sin6_addr, &in6addr_any, sizeof(struct in6_addr)) == 0)
-			continue;
-
-		if (memcmp(&addr->sin6_addr, &cand, sizeof(struct in6_addr)) == 0)
-			return ifs;
-
-		if (IN6_IS_ADDR_LINKLOCAL(&addr->sin6_addr))
-			return ifs;
-	}
+static char       *conf_file;
+static struct conf base;		/* Command line settings */
+static struct conf cur;			/* ... with the config file on top */
 
-	return NULL;
-}
+static struct timer rescan_timer;	/* Interface scan, every refresh sec */
+static int          resnap;		/* Identity changed, rewrite snapshot */
 
-/* Exact match, must be same ifaddr as sa */
-static struct ifsock *find_iface(struct sockaddr *sa)
-{
-	struct ifsock *ifs;
+static int mcast_sd   = -1;
+static int mcast_sd6  = -1;
+static int shared_sd  = -1;
+static int shared_sd6 = -1;
 
-	if (!sa)
-		return NULL;
-
-	LIST_FOREACH(ifs, &il, link) {
-		if (sa->sa_family == AF_INET) {
-			struct sockaddr_in *addr = (struct sockaddr_in *) sa;
-			const struct sockaddr_in *i_addr = (struct sockaddr_in *) &ifs->addr;
-			if (i_addr->sin_addr.s_addr == addr->sin_addr.s_addr)
-				return ifs;
-		}
-		else if (sa->sa_family == AF_INET6) {
-			struct sockaddr_in6 *addr = (struct sockaddr_in6 *) sa;
-			const struct sockaddr_in6 *i_addr = (struct sockaddr_in6 *) &ifs->addr;
-			if (memcmp(&i_addr->sin6_addr, &i_addr->sin6_addr, sizeof(i_addr->sin6_addr)) == 0)
-			/* ipv6 listen on in6addr_any */
-			if (memcmp(&addr->sin6_addr, &i_addr->sin6_addr, sizeof(i_addr->sin6_addr)) == 0
-				|| memcmp(&addr->sin6_addr, &in6addr_any, sizeof(i_addr->sin6_addr)) == 0)
-				return ifs;
-		}
-	}
+static struct pollfd *pfd;
+static size_t         pfd_max;
 
-	return NULL;
-}
+static int   *members;
+static size_t member_num;
+static size_t member_max;
 
-int register_socket(int in, int out, struct sockaddr *addr, struct sockaddr *mask, void (*cb)(int sd))
+static int is_shared(int sd)
 {
-	struct ifsock *ifs;
-	struct sockaddr_in *address = (struct sockaddr_in *)addr;
-	struct sockaddr_in *netmask = (struct sockaddr_in *)mask;
-
-	ifs = calloc(1, sizeof(*ifs));
-	if (!ifs) {
-		char *host = inet_ntoa(address->sin_addr);
-
-		logit(LOG_ERR, "Failed registering host %s socket: %s", host, strerror(errno));
-		return -1;
-	}
-
-	ifs->in   = in;
-	ifs->out  = out;
-	ifs->mod  = 1;
-	ifs->cb   = cb;
-	ifs->addr = * (struct sockaddr_storage *) address;
-	if (mask)
-		ifs->mask = *netmask;
-	LIST_INSERT_HEAD(&il, ifs, link);
-
-	return 0;
+	return sd != -1 && (sd == shared_sd || sd == shared_sd6);
 }
 
 static int open_socket(char *ifname, struct sockaddr *addr, int port)
@@ -297,21 +246,25 @@ static int open_socket(char *ifname, struct sockaddr *addr, int port)
 static int close_socket(void)
 {
 	int ret = 0;
-	struct ifsock *ifs, *tmp;
+	struct ifsock *ifs;
 
-	LIST_FOREACH_SAFE(ifs, &il, link, tmp) {
-		LIST_REMOVE(ifs, link);
-		if (ifs->out != -1)
-			ret |= close(ifs->out);
-		else
+	IFS_FOREACH(ifs) {
+		if (ifs->out == -1)
 			ret |= close(ifs->in);
-		free(ifs);
+		else if (!is_shared(ifs->out))
+			ret |= close(ifs->out);
 	}
+	free_sockets();
+
+	while (member_num > 0)
+		ret |= close(members[--member_num]);
+	free(members);
+	free(pfd);
 
 	return ret;
 }
 
-static int filter_addr(struct sockaddr *sa)
+static int filter_addr(struct sockaddr *sa, char *ifname)
 {
 	struct ifsock *ifs;
 
@@ -345,7 +298,8 @@ static int filter_addr(struct sockaddr *sa)
 		if (!IN6_IS_ADDR_LINKLOCAL(&sin->sin6_addr))
 			return 1;
 
-		ifs = find_outbound6(sa);
+		/* One link-local address per interface */
+		ifs = find_ingress(sa, if_nametoindex(ifname));
 		if (ifs) {
 			const struct sockaddr_in6 *addr = (struct sockaddr_in6 *) &ifs->addr;
 			if (memcmp(&addr->sin6_addr, &in6addr_any, sizeof(addr->sin6_addr)) != 0)
@@ -378,106 +332,6 @@ static int filter_iface(char *ifname, char *iflist[], size_t num)
 	return 1;
 }
 
-static void compose_addr(struct sockaddr_in *sin, char *group, int port)
-{
-	memset(sin, 0, sizeof(*sin));
-	sin->sin_family      = AF_INET;
-	sin->sin_port        = htons(port);
-	sin->sin_addr.s_addr = inet_addr(group);
-}
-
-static void compose_addr6(struct sockaddr_in6 *sin, char *group, int port)
-{
-	memset(sin, 0, sizeof(*sin));
-	sin->sin6_family      = AF_INET6;
-	sin->sin6_port        = htons(port);
-	inet_pton(AF_INET6, group, &sin->sin6_addr);
-}
-
-static void compose_response(char *type, char *host, char *buf, size_t len)
-{
-	char usn[256];
-	char date[42];
-	time_t now;
-
-	/* RFC1123 date, as specified in RFC2616 */
-	now = time(NULL);
-	strftime(date, sizeof(date), "%a, %d %b %Y %T %Z", gmtime(&now));
-
-	if (type) {
-		if (!strcmp(type, uuid))
-			type = NULL;
-		else
-			snprintf(usn, sizeof(usn), "%s::%s", uuid, type);
-	}
-
-	if (!type)
-		strncpy(usn, uuid, sizeof(usn));
-
-	snprintf(buf, len, "HTTP/1.1 200 OK\r\n"
-		 "Server: %s\r\n"
-		 "Date: %s\r\n"
-		 "Location: http://%s:%d%s\r\n"
-		 "ST: %s\r\n"
-		 "EXT: \r\n"
-		 "USN: %s\r\n"
-		 "Cache-Control: max-age=%d\r\n"
-		 "\r\n",
-		 server_string,
-		 date,
-		 host, LOCATION_PORT, LOCATION_DESC,
-		 type,
-		 usn,
-		 CACHE_TIMEOUT);
-}
-
-static void compose_search(char *type, char *buf, size_t len)
-{
-	snprintf(buf, len, "M-SEARCH * HTTP/1.1\r\n"
-		 "Host: %s:%d\r\n"
-		 "MAN: \"ssdp:discover\"\r\n"
-		 "MX: 1\r\n"
-		 "ST: %s\r\n"
-		 "User-Agent: %s\r\n"
-		 "\r\n",
-		 MC_SSDP_GROUP, MC_SSDP_PORT,
-		 type,
-		 server_string);
-}
-
-static void compose_notify(char *type, char *host, char *buf, size_t len)
-{
-	char usn[256];
-
-	if (type) {
-		if (!strcmp(type, SSDP_ST_ALL))
-			type = NULL;
-		else
-			snprintf(usn, sizeof(usn), "%s::%s", uuid, type);
-	}
-
-	if (!type) {
-		type = usn;
-		strncpy(usn, uuid, sizeof(usn));
-	}
-
-	snprintf(buf, len, "NOTIFY * HTTP/1.1\r\n"
-		 "Host: %s:%d\r\n"
-		 "Server: %s\r\n"
-		 "Location: http://%s:%d%s\r\n"
-		 "NT: %s\r\n"
-		 "NTS: ssdp:alive\r\n"
-		 "USN: %s\r\n"
-		 "Cache-Control: max-age=%d\r\n"
-		 "\r\n",
-		 MC_SSDP_GROUP, MC_SSDP_PORT,
-		 server_string,
-		 host, LOCATION_PORT, LOCATION_DESC,
-		 type,
-		 usn,
-		 CACHE_TIMEOUT);
-}
-
 size_t pktlen(unsigned char *buf)
 {
 	size_t hdr = sizeof(struct udphdr);
@@ -485,166 +339,89 @@ size_t pktlen(unsigned char *buf)
 	return strlen((char *)buf + hdr) + hdr;
 }
 
-static void send_search(struct ifsock *ifs, char *type)
-{
-	ssize_t num;
-	char buf[MAX_PKT_SIZE];
-	struct sockaddr dest;
-
-	memset(buf, 0, sizeof(buf));
-	compose_search(type, buf, sizeof(buf));
-
-	if (ifs->addr.ss_family == AF_INET)
-		compose_addr((struct sockaddr_in *)&dest, MC_SSDP_GROUP, MC_SSDP_PORT);
-	else if (ifs->addr.ss_family == AF_INET6)
-		compose_addr6((struct sockaddr_in6 *)&dest, MC_SSDP_GROUP_IPV6, MC_SSDP_PORT);
-
-	logit(LOG_DEBUG, "Sending M-SEARCH ...");
-	num = sendto(ifs->out, buf, strlen(buf), 0, &dest, sizeof(struct sockaddr_storage));
-	if (num < 0)
-		logit(LOG_WARNING, "Failed sending SSDP M-SEARCH");
-}
-
-static void send_message(struct ifsock *ifs, char *type, struct sockaddr *sa)
+/*
+ * The kernel receive timestamp, kts, is CLOCK_REALTIME.  Latency is in
+ * CLOCK_MONOTONIC, which is not stepped, so only the age of kts is used.
+ */
+static void rx_time(struct timespec *rx, struct timespec *kts)
 {
-	int s;
-	size_t i, len, note = 0;
-	ssize_t num;
-	char host[NI_MAXHOST];
-	char host6[NI_MAXHOST+2];
-	char *host_out;
-	char buf[MAX_PKT_SIZE];
-	struct sockaddr_storage dest;
+	struct timespec now;
+	int64_t age;
 
-	gethostname(hostname, sizeof(hostname));
-	s = getnameinfo((struct sockaddr *)&ifs->addr, sizeof(struct sockaddr_storage),
-			host, sizeof(host), NULL, 0, NI_NUMERICHOST);
-	if (s) {
-		logit(LOG_WARNING, "Failed getnameinfo(): %s", gai_strerror(s));
+	clock_gettime(CLOCK_MONOTONIC, rx);
+	if (!kts)
 		return;
-	}
 
-	if (ifs->addr.ss_family == AF_INET) {
-		const struct sockaddr_in *addr = (struct sockaddr_in *) &ifs->addr;
-		if (addr->sin_addr.s_addr == htonl(INADDR_ANY))
-			return;
-	}
-	else if (ifs->addr.ss_family == AF_INET6) {
-		const struct sockaddr_in6 *addr = (struct sockaddr_in6 *) &ifs->addr;
-		if (memcmp(&addr->sin6_addr, &in6addr_any, sizeof(struct in6_addr)) == 0)
-			return;
-	}
-	if (ifs->out == -1)
+	clock_gettime(CLOCK_REALTIME, &now);
+	age = (int64_t)(now.tv_sec - kts->tv_sec) * 1000000000 + (now.tv_nsec - kts->tv_nsec);
+	if (age <= 0 || age > (int64_t)rx->tv_sec * 1000000000)
 		return;
 
-	if (!strcmp(type, SSDP_ST_ALL))
-		type = NULL;
-
-	host_out = host;
-	if (ifs->addr.ss_family == AF_INET6) {
-		char *pos = strchr(host, '%');
-		if (pos) {
-			*pos = '\0';
-			snprintf(host6, NI_MAXHOST+2, "[%s]", host);
-			host_out = host6;
-		}
-	}
-
-	memset(buf, 0, sizeof(buf));
-	if (sa)
-		compose_response(type, host_out, buf, sizeof(buf));
-	else
-		compose_notify(type, host_out, buf, sizeof(buf));
-
-	if (!sa) {
-		note = 1;
-		if (ifs->addr.ss_family == AF_INET)
-			compose_addr((struct sockaddr_in *)&dest, MC_SSDP_GROUP, MC_SSDP_PORT);
-		else if (ifs->addr.ss_family == AF_INET6)
-			compose_addr6((struct sockaddr_in6 *)&dest, MC_SSDP_GROUP_IPV6, MC_SSDP_PORT);
-		sa = (struct sockaddr *) &dest;
+	rx->tv_sec  -= age / 1000000000;
+	rx->tv_nsec -= age % 1000000000;
+	if (rx->tv_nsec < 0) {
+		rx->tv_nsec += 1000000000;
+		rx->tv_sec--;
 	}
-
-	logit(LOG_DEBUG, "Sending %s from %s ...", !note ? "reply" : "notify", host);
-	num = sendto(ifs->out, buf, strlen(buf), 0, sa, sizeof(struct sockaddr_storage));
-	if (num < 0)
-		logit(LOG_WARNING, "Failed sending SSDP %s, type: %s: %s", !note ? "reply" : "notify", type, strerror(errno));
 }
 
+/*
+ * Receive one datagram.  The kernel tells, with SO_RXQ_OVFL, how many
+ * have been dropped on the socket so far, see socket_dropped(), with
+ * SO_TIMESTAMPNS when it arrived, so the time it was queued is included
+ * in the reply latency, and with IP_PKTINFO/IPV6_PKTINFO on which
+ * interface.
+ */
 static void ssdp_recv(int sd)
 {
+	union {
+		char buf[CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(struct timespec)) +
+			 CMSG_SPACE(sizeof(struct in6_pktinfo))];
+		struct cmsghdr align;
+	} ctl;
+	struct timespec *kts = NULL;
+	int ifindex = 0;
 	ssize_t len;
 	struct sockaddr_storage sa;
-	socklen_t salen = sizeof(sa);
+	struct cmsghdr *cmsg;
+	struct timespec rx;
+	struct msghdr msg;
+	struct iovec iov;
 	char buf[MAX_PKT_SIZE];
 
 	memset(buf, 0, sizeof(buf));
-	len = recvfrom(sd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *) &sa, &salen);
+	iov.iov_base = buf;
+	iov.iov_len  = sizeof(buf) - 1;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name       = &sa;
+	msg.msg_namelen    = sizeof(sa);
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+
+	len = recvmsg(sd, &msg, MSG_DONTWAIT);
+	TRACE3(recv, sd, len, sa.ss_family);
+	if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		stats.empty_reads++;
 	if (len > 0) {
-		buf[len] = 0;
-
-		if (sa.ss_family != AF_INET && sa.ss_family != AF_INET6)
-			return;
-
-		if (strstr(buf, "M-SEARCH *")) {
-			size_t i;
-			char *ptr, *type;
-			struct ifsock *ifs = NULL;
-
-			char addr[INET6_ADDRSTRLEN];
-			int port = -1;
-			if (sa.ss_family == AF_INET) {
-				struct sockaddr_in *sin = (struct sockaddr_in *)&sa;
-
-				ifs = find_outbound((struct sockaddr *) &sa);
-				inet_ntop(AF_INET, &sin->sin_addr, addr, INET_ADDRSTRLEN);
-				port = ntohs(sin->sin_port);
-			}
-			else if (sa.ss_family == AF_INET6) {
-				struct sockaddr_in6 *sin = (struct sockaddr_in6 *) &sa;
-
-				ifs = find_outbound6((struct sockaddr *) &sa);
-				inet_ntop(AF_INET6, &sin->sin6_addr, addr, INET6_ADDRSTRLEN);
-				port = ntohs(sin->sin6_port);
-			}
-
-			if (!ifs) {
-				logit(LOG_DEBUG, "No matching socket for client %s", addr);
-				return;
-			}
-			logit(LOG_DEBUG, "Matching socket for client %s", addr);
-
-			type = strcasestr(buf, "\r\nST:");
-			if (!type) {
-				logit(LOG_DEBUG, "No Search Type (ST:) found in M-SEARCH *, assuming " SSDP_ST_ALL);
-				type = SSDP_ST_ALL;
-				send_message(ifs, type, (struct sockaddr *) &sa);
-				return;
-			}
-
-			type = strchr(type, ':');
-			if (!type)
-				return;
-			type++;
-			while (isspace(*type))
-				type++;
-
-			ptr = strstr(type, "\r\n");
-			if (!ptr)
-				return;
-			*ptr = 0;
-
-			for (i = 0; supported_types[i]; i++) {
-				if (!strcmp(supported_types[i], type)) {
-					logit(LOG_DEBUG, "M-SEARCH * ST: %s from %s port %d", type,
-					      addr, port);
-					send_message(ifs, type, (struct sockaddr *) &sa);
-					return;
-				}
-			}
-
-			logit(LOG_DEBUG, "M-SEARCH * for unsupported ST: %s from %s", type, addr);
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO)
+				ifindex = ((struct in_pktinfo *)CMSG_DATA(cmsg))->ipi_ifindex;
+			else if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO)
+				ifindex = ((struct in6_pktinfo *)CMSG_DATA(cmsg))->ipi6_ifindex;
+			if (cmsg->cmsg_level != SOL_SOCKET)
+				continue;
+			if (cmsg->cmsg_type == SO_RXQ_OVFL)
+				socket_dropped(sd, *(uint32_t *)CMSG_DATA(cmsg));
+			else if (cmsg->cmsg_type == SCM_TIMESTAMPNS)
+				kts = (struct timespec *)CMSG_DATA(cmsg);
 		}
+
+		buf[len] = 0;
+		rx_time(&rx, kts);
+		ssdp_input(buf, len, (struct sockaddr *) &sa, ifindex, &rx);
 	}
 }
 
@@ -674,7 +451,7 @@ static int multicast_init(void)
 		return -1;
 	}
 
-	register_socket(sd, -1, &sa, NULL, ssdp_recv);
+	register_socket(sd, -1, NULL, &sa, NULL, ssdp_recv);
 
 	return sd;
 }
@@ -708,7 +485,47 @@ static int multicast_init6(void)
 		return -1;
 	}
 
-	register_socket(sd, -1, (struct sockaddr *) &sin, NULL, ssdp_recv);
+	register_socket(sd, -1, NULL, (struct sockaddr *) &sin, NULL, ssdp_recv);
+
+	return sd;
+}
+
+/*
+ * Linux limits IPv4 group memberships per socket, igmp_max_memberships,
+ * by default 20.  The multicast socket receives the group on all joined
+ * interfaces, so the rest of the memberships are held by extra sockets
+ * that are never read from.
+ */
+static int member_add(int sd)
+{
+	int *tmp;
+
+	if (member_num == member_max) {
+		size_t max = member_max ? member_max * 2 : 8;
+
+		tmp = realloc(members, max * sizeof(*members));
+		if (!tmp)
+			return -1;
+		members = tmp;
+		member_max = max;
+	}
+	members[member_num++] = sd;
+
+	return 0;
+}
+
+static int member_sd(void)
+{
+	int sd;
+
+	sd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sd < 0)
+		return -1;
+
+	if (member_add(sd)) {
+		close(sd);
+		return -1;
+	}
 
 	return sd;
 }
@@ -725,6 +542,16 @@ static int multicast_join(int sd, struct sockaddr *sa)
 		if (EADDRINUSE == errno)
 			return 0;
 
+		if (ENOBUFS == errno) {
+			sd = member_num ? members[member_num - 1] : -1;
+			if (sd != -1 && !setsockopt(sd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)))
+				return 0;
+
+			sd = member_sd();
+			if (sd != -1 && !setsockopt(sd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)))
+				return 0;
+		}
+
 		logit(LOG_ERR, "Failed joining group %s: %s", MC_SSDP_GROUP, strerror(errno));
 		return -1;
 	}
@@ -739,9 +566,13 @@ static int multicast_join6(int sd, struct sockaddr *sa, char *name)
 
 	memset(&mreq, 0, sizeof(mreq));
 	inet_pton(AF_INET6, MC_SSDP_GROUP_IPV6, &mreq.ipv6mr_multiaddr);
+	if (name)
+		mreq.ipv6mr_interface = if_nametoindex(name);
 
 	if (setsockopt(sd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq))) {
-		close(sd);
+		if (EADDRINUSE == errno)
+			return 0;
+
 		logit(LOG_ERR, "Failed joining group %s: %s", MC_SSDP_GROUP_IPV6, strerror(errno));
 		return -1;
 	}
@@ -749,11 +580,60 @@ static int multicast_join6(int sd, struct sockaddr *sa, char *name)
 	return 0;
 }
 
+/*
+ * With -s all interfaces share one outbound socket per address family,
+ * the source is given per packet with IP_PKTINFO.  For IPv4 it is bound
+ * to *:1900 to also receive unicast M-SEARCH and replies to our own, but
+ * must not receive the group, the multicast socket does that.  For IPv6
+ * the multicast socket is already bound to [::]:1900 and is reused.
+ */
+static int shared_init(int sd6)
+{
+	struct sockaddr_storage ss;
+	struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+	int sd, val;
+
+	sd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sd < 0) {
+		logit(LOG_ERR, "Failed opening shared socket: %s", strerror(errno));
+		return -1;
+	}
+
+	ENABLE_SOCKOPT(sd, SOL_SOCKET, SO_REUSEADDR);
+	ENABLE_SOCKOPT(sd, SOL_SOCKET, SO_REUSEPORT);
+	DISABLE_SOCKOPT(sd, IPPROTO_IP, IP_MULTICAST_ALL);
+	DISABLE_SOCKOPT(sd, IPPROTO_IP, IP_MULTICAST_LOOP);
+
+	val = 2;		/* Same as open_socket() */
+	if (setsockopt(sd, IPPROTO_IP, IP_MULTICAST_TTL, &val, sizeof(val)))
+		logit(LOG_WARNING, "Failed setting multicast TTL: %s", strerror(errno));
+
+	memset(&ss, 0, sizeof(ss));
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(MC_SSDP_PORT);
+	if (bind(sd, (struct sockaddr *)sin, sizeof(*sin)) < 0) {
+		close(sd);
+		logit(LOG_ERR, "Failed binding shared socket to *:%d: %s", MC_SSDP_PORT, strerror(errno));
+		return -1;
+	}
+
+	if (register_socket(sd, -1, NULL, (struct sockaddr *)&ss, NULL, ssdp_recv)) {
+		close(sd);
+		return -1;
+	}
+	shared_sd = sd;
+
+	DISABLE_SOCKOPT(sd6, IPPROTO_IPV6, IPV6_MULTICAST_LOOP);
+	shared_sd6 = sd6;
+
+	return 0;
+}
+
 static void mark(void)
 {
 	struct ifsock *ifs;
 
-	LIST_FOREACH(ifs, &il, link) {
+	IFS_FOREACH(ifs) {
 		if (ifs->out != -1)
 			ifs->stale = 1;
 		else
@@ -764,28 +644,33 @@ static void mark(void)
 static int sweep(void)
 {
 	int modified = 0;
-	struct ifsock *ifs, *tmp;
+	struct ifsock *ifs;
 
-	LIST_FOREACH_SAFE(ifs, &il, link, tmp) {
+	IFS_FOREACH(ifs) {
 		if (!ifs->stale)
 			continue;
 
 		modified++;
-		char str[INET6_ADDRSTRLEN];
-		if (ifs->addr.ss_family == AF_INET) {
-			const struct sockaddr_in *addr = (struct sockaddr_in *) &ifs->addr;
-			inet_ntop(AF_INET, &addr->sin_addr, str, INET_ADDRSTRLEN);
-		}
-		else if (ifs->addr.ss_family == AF_INET6) {
-			const struct sockaddr_in6 *addr = (struct sockaddr_in6 *) &ifs->addr;
-			inet_ntop(AF_INET6, &addr->sin6_addr, str, INET6_ADDRSTRLEN);
+		if (log_enabled(LOG_DEBUG)) {
+			char str[INET6_ADDRSTRLEN] = "";
+
+			if (ifs->addr.ss_family == AF_INET) {
+				const struct sockaddr_in *addr = (struct sockaddr_in *) &ifs->addr;
+				inet_ntop(AF_INET, &addr->sin_addr, str, INET_ADDRSTRLEN);
+			}
+			else if (ifs->addr.ss_family == AF_INET6) {
+				const struct sockaddr_in6 *addr = (struct sockaddr_in6 *) &ifs->addr;
+				inet_ntop(AF_INET6, &addr->sin6_addr, str, INET6_ADDRSTRLEN);
+			}
+			logit(LOG_DEBUG, "Removing stale ifs %s", str);
 		}
-		logit(LOG_DEBUG, "Removing stale ifs %s", str);
+		TRACE2(iface_del, ifs->ifname, ifs->addr.ss_family);
 
-		LIST_REMOVE(ifs, link);
-		close(ifs->out);
-		free(ifs);
+		if (!is_shared(ifs->out))
+			close(ifs->out);
+		unregister_socket(ifs);
 	}
+	compact_sockets();
 
 	return modified;
 }
@@ -810,20 +695,11 @@ static int ssdp_init(int in, int in6, char *iflist[], size_t num)
 	for (ifa = ifaddrs; ifa; ifa = ifa->ifa_next) {
 		struct ifsock *ifs;
 
-		char addr[128];
-		if (ifa->ifa_addr->sa_family == AF_INET) {
-			// create IPv4 string
-			struct sockaddr_in *in = (struct sockaddr_in*) ifa->ifa_addr;
-			inet_ntop(AF_INET, &in->sin_addr, addr, sizeof(addr));
-		} else { // AF_INET6
-			// create IPv6 string
-			struct sockaddr_in6 *in6 = (struct sockaddr_in6*) ifa->ifa_addr;
-			inet_ntop(AF_INET6, &in6->sin6_addr, addr, sizeof(addr));
-		}
-		/* Do we already have it? */
+		/* Do we already have it, and do we still want it? */
 		ifs = find_iface(ifa->ifa_addr);
 		if (ifs) {
-			ifs->stale = 0;
+			if (!filter_iface(ifa->ifa_name, iflist, num))
+				ifs->stale = 0;
 			continue;
 		}
 	}
@@ -842,29 +718,45 @@ static int ssdp_init(int in, int in6, char *iflist[], size_t num)
 		}
 
 		/* Do we have another in the same subnet? */
-		if (filter_addr(ifa->ifa_addr))
+		if (filter_addr(ifa->ifa_addr, ifa->ifa_name))
 			continue;
 
-		sd = open_socket(ifa->ifa_name, ifa->ifa_addr, MC_SSDP_PORT);
-		if (sd < 0)
-			continue;
+		if (shared) {
+			if (ifa->ifa_addr->sa_family == AF_INET)
+				sd = shared_sd;
+			else if (ifa->ifa_addr->sa_family == AF_INET6)
+				sd = shared_sd6;
+			else
+				continue;
+		} else {
+			sd = open_socket(ifa->ifa_name, ifa->ifa_addr, MC_SSDP_PORT);
+			if (sd < 0)
+				continue;
+		}
 
 		if (ifa->ifa_addr->sa_family == AF_INET) {
 			multicast_join(in, ifa->ifa_addr);
 
-			if (register_socket(in, sd, ifa->ifa_addr, ifa->ifa_netmask, ssdp_recv)) {
-				close(sd);
+			if (register_socket(in, sd, ifa->ifa_name, ifa->ifa_addr, ifa->ifa_netmask, ssdp_recv)) {
+				if (!shared)
+					close(sd);
 				break;
 			}
 		}
 		else if (ifa->ifa_addr->sa_family == AF_INET6) {
-			multicast_join6(in6, ifa->ifa_addr, NULL);
+			/* The shared socket has not joined on each interface */
+			multicast_join6(in6, ifa->ifa_addr, shared ? ifa->ifa_name : NULL);
 
-			if (register_socket(in6, sd, ifa->ifa_addr, ifa->ifa_netmask, ssdp_recv)) {
-				close(sd);
+			if (register_socket(in6, sd, ifa->ifa_name, ifa->ifa_addr, ifa->ifa_netmask, ssdp_recv)) {
+				if (!shared)
+					close(sd);
 				break;
 			}
 		}
+
+		if (shared)
+			IFS_NEWEST()->ifindex = if_nametoindex(ifa->ifa_name);
+		TRACE2(iface_add, ifa->ifa_name, ifa->ifa_addr->sa_family);
 		modified++;
 	}
 
@@ -875,41 +767,82 @@ static int ssdp_init(int in, int in6, char *iflist[], size_t num)
 
 static void handle_message(int sd)
 {
-	struct ifsock *ifs;
+	if (dispatch_socket(sd))
+		logit(LOG_WARNING, "No handler for socket %d", sd);
+}
 
-	LIST_FOREACH(ifs, &il, link) {
-		if (ifs->in != sd)
-			continue;
+/*
+ * Reserve room for num entries in the poll set.  Grows by doubling and
+ * never shrinks, so after startup the set is stable in size.
+ */
+static int pfd_reserve(size_t num)
+{
+	struct pollfd *tmp;
+	size_t max;
+
+	if (num <= pfd_max)
+		return 0;
 
-		if (ifs->cb)
-			ifs->cb(sd);
+	max = pfd_max ? pfd_max : 16;
+	while (max < num)
+		max *= 2;
+
+	tmp = realloc(pfd, max * sizeof(*pfd));
+	if (!tmp) {
+		logit(LOG_ERR, "Failed growing poll set to %zu: %s", max, strerror(errno));
+		return -1;
 	}
+	pfd = tmp;
+	pfd_max = max;
+
+	return 0;
 }
 
-static void wait_message(time_t tmo)
+/* Wait for, and handle, messages until tmo, msec CLOCK_MONOTONIC */
+static void wait_message(uint64_t tmo)
 {
 	int num = 1, timeout;
-	size_t ifnum = 0;
-	struct pollfd pfd[MAX_NUM_IFACES];
+	size_t ifnum = 0, total;
 	struct ifsock *ifs;
+	unsigned gen;
 
-	LIST_FOREACH(ifs, &il, link) {
-		if (ifs->out != -1)
-			continue;
+	IFS_FOREACH(ifs) {
+		int sd = ifs->in;
 
-		pfd[ifnum].fd = ifs->in;
+		if (ifs->out != -1) {
+			/* Unicast replies to our M-SEARCH land on the outbound socket */
+			if (!neighbors || is_shared(ifs->out))
+				continue;
+			sd = ifs->out;
+		}
+
+		if (pfd_reserve(ifnum + 1))
+			break;
+
+		pfd[ifnum].fd = sd;
 		pfd[ifnum].events = POLLIN | POLLHUP;
 		ifnum++;
 	}
 
+	/* ssdpctl and HTTP clients last, rebuilt when they come and go */
+	total = ifnum;
+	if (!pfd_reserve(ifnum + conn_count()))
+		total += conn_poll(&pfd[ifnum]);
+	gen = conn_gen();
+
 	while (1) {
 		size_t i;
+		uint64_t now;
 
-		timeout = tmo - time(NULL);
-		if (timeout < 0)
+		/* Timers started while waiting, e.g., neighbor expiry */
+		now = timer_now();
+		tmo = MIN(tmo, timer_next());
+
+		if (tmo <= now)
 			break;
+		timeout = tmo - now;
 
-		num = poll(pfd, ifnum, timeout * 1000);
+		num = poll(pfd, total, timeout);
 		if (num < 0) {
 			if (EINTR == errno)
 				break;
@@ -926,31 +859,539 @@ static void wait_message(time_t tmo)
 				num--;
 			}
 		}
+		for (; num > 0 && i < total; i++) {
+			if (pfd[i].revents) {
+				conn_event(pfd[i].fd, pfd[i].revents);
+				num--;
+			}
+		}
+
+		/* Handed over, the sockets are no longer ours to read */
+		if (!running || gen != conn_gen())
+			break;
 	}
 }
 
-static void announce(int mod)
+/* Token bucket shared by all interfaces, pps tokens per second */
+static int pace(uint64_t now, int cost, uint64_t *next)
 {
+	static double tokens;
+	static uint64_t last;
+	double burst;
+
+	if (!pps)
+		return 1;
+
+	/* Allow a tenth of a second worth of packets back to back */
+	burst = MAX(pps / 10.0, cost);
+	tokens += (now - last) * pps / 1000.0;
+	if (!last || tokens > burst)
+		tokens = burst;
+	last = now;
+
+	if (tokens < cost) {
+		*next = MIN(*next, now + (uint64_t)((cost - tokens) * 1000 / pps) + 1);
+		return 0;
+	}
+
+	tokens -= cost;
+	return 1;
+}
+
+/*
+ * NOTIFY is sent as a stream rather than in bursts.  Each interface has
+ * its own timer: a new one is announced within NOTIFY_JITTER msec, then
+ * again at a random phase in the interval, and after that a bit less
+ * than the interval apart, with random jitter.  All interfaces share
+ * the pps ceiling, when it is reached the timer is set to when there is
+ * room again.
+ */
+static void announce(void *arg, uint64_t now)
+{
+	uint64_t next, ival = interval * 1000;
+	struct ifsock *ifs = arg;
+	int cost = 0;
+	size_t i;
+
+	for (i = 0; supported_types[i]; i++) {
+		if (strcmp(supported_types[i], uuid))
+			cost++;
+	}
+
+	next = UINT64_MAX;
+	if (!pace(now, cost + (neighbors && ifs->mod), &next)) {
+		timer_start(&ifs->notify, next, announce, ifs);
+		return;
+	}
+
+	TRACE1(announce_begin, ifs->ifname);
+
+	/* Probe for neighbors on new interfaces, the rest announce themselves */
+	if (neighbors && ifs->mod)
+		send_search(ifs, SSDP_ST_ALL);
+
+	for (i = 0; supported_types[i]; i++) {
+		/* UUID sent in SSDP_ST_ALL, first announce */
+		if (!strcmp(supported_types[i], uuid))
+			continue;
+
+		send_message(ifs, supported_types[i], NULL, NULL);
+	}
+
+	if (ifs->mod)
+		next = now + 1 + rand() % ival;
+	else
+		next = now + ival - rand() % (ival / 10);
+	ifs->mod = 0;
+	timer_start(&ifs->notify, next, announce, ifs);
+
+	TRACE1(announce_end, ifs->ifname);
+}
+
+/* Schedule the next NOTIFY at msec, or within NOTIFY_JITTER if zero */
+static void schedule(struct ifsock *ifs, uint64_t now, uint64_t at)
+{
+	if (ifs->out == -1)
+		return;
+
+	if (!at)
+		at = now + 1 + rand() % NOTIFY_JITTER;
+	timer_start(&ifs->notify, at, announce, ifs);
+}
+
+static int ho_send(int sd, int type, void *data, size_t len, size_t num, int *fds, size_t nfds)
+{
+	char cbuf[CMSG_SPACE(HANDOVER_MAX_FDS * sizeof(int))];
+	struct ho_hdr hdr;
+	struct msghdr msg;
+	struct iovec iov[2];
+	ssize_t rc;
+
+	hdr.magic   = HANDOVER_MAGIC;
+	hdr.version = HANDOVER_VERSION;
+	hdr.type    = type;
+	hdr.num     = type == HO_FDS ? nfds : num;
+	hdr.size    = sizeof(struct ho_ifs);
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len  = sizeof(hdr);
+	iov[1].iov_base = data;
+	iov[1].iov_len  = len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov    = iov;
+	msg.msg_iovlen = len ? 2 : 1;
+
+	if (nfds) {
+		struct cmsghdr *cmsg;
+
+		memset(cbuf, 0, sizeof(cbuf));
+		msg.msg_control    = cbuf;
+		msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type  = SCM_RIGHTS;
+		cmsg->cmsg_len   = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	}
+
+	rc = sendmsg(sd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (rc != (ssize_t)(sizeof(hdr) + len))
+		return -1;
+
+	return 0;
+}
+
+/* Index of sd in the descriptor table, added on first use */
+static int32_t ho_index(int *map, int *fds, size_t *num, int sd)
+{
+	if (sd == -1)
+		return -1;
+
+	if (map[sd] == -1) {
+		map[sd] = *num;
+		fds[(*num)++] = sd;
+	}
+
+	return map[sd];
+}
+
+/*
+ * Hot restart, called from the control socket when a new ssdpd started
+ * with -t asks for our sockets.  Every socket is passed with SCM_RIGHTS,
+ * along with the interface table, UUID and server string.  The sockets
+ * stay open, so their multicast memberships and anything queued are
+ * kept, the new process picks up where we stop reading.
+ *
+ * Everything is queued on sd at once, without waiting for the peer, and
+ * we keep serving until it acks, see handover_done().  A peer that does
+ * not is dropped with the rest of the slow control clients.
+ */
+int handover(int sd)
+{
+	struct ho_ifs *rec = NULL;
+	struct ucred cred = { 0 };
+	socklen_t len = sizeof(cred);
 	struct ifsock *ifs;
+	struct ho_end end;
+	int *map = NULL, *fds = NULL;
+	size_t i, num = 0, nfds = 0, msgs;
+	int maxfd = 0, rc = -1, sz;
 
-	logit(LOG_INFO, "Sending SSDP NOTIFY new:%d ...", mod);
+	if (getsockopt(sd, SOL_SOCKET, SO_PEERCRED, &cred, &len) || cred.uid != geteuid()) {
+		logit(LOG_WARNING, "Refusing handover to uid %d", (int)cred.uid);
+		return -1;
+	}
 
-	LIST_FOREACH(ifs, &il, link) {
-		size_t i;
+	IFS_FOREACH(ifs) {
+		maxfd = MAX(maxfd, MAX(ifs->in, ifs->out));
+		num++;
+	}
+	for (i = 0; i < member_num; i++)
+		maxfd = MAX(maxfd, members[i]);
+	maxfd = MAX(maxfd, MAX(mcast_sd, mcast_sd6));
+	maxfd = MAX(maxfd, MAX(shared_sd, shared_sd6));
+
+	rec = calloc(num, sizeof(*rec));
+	map = malloc((maxfd + 1) * sizeof(*map));
+	fds = malloc((2 * num + member_num + 4) * sizeof(*fds));
+	if (!rec || !map || !fds) {
+		logit(LOG_ERR, "Failed handover: %s", strerror(errno));
+		goto done;
+	}
+	memset(map, -1, (maxfd + 1) * sizeof(*map));
+
+	num = 0;
+	IFS_FOREACH(ifs) {
+		struct ho_ifs *r = &rec[num++];
+
+		r->in        = ho_index(map, fds, &nfds, ifs->in);
+		r->out       = ho_index(map, fds, &nfds, ifs->out);
+		r->kind      = ifs->cb == ssdp_recv ? HO_SSDP : ifs->cb == web_recv ? HO_WEB : HO_CTL;
+		r->ifindex   = ifs->ifindex;
+		r->mod       = ifs->mod;
+		r->notify_at = ifs->notify.pending ? ifs->notify.expires : 0;
+		memcpy(r->ifname, ifs->ifname, sizeof(r->ifname));
+		r->addr      = ifs->addr;
+		r->mask      = ifs->mask;
+		r->stats     = ifs->stats;
+	}
+
+	memset(&end, 0, sizeof(end));
+	memcpy(end.uuid, uuid, sizeof(end.uuid));
+	memcpy(end.server, server_string, sizeof(end.server));
+	end.shared     = shared;
+	end.sd         = ho_index(map, fds, &nfds, mcast_sd);
+	end.sd6        = ho_index(map, fds, &nfds, mcast_sd6);
+	end.shared_sd  = ho_index(map, fds, &nfds, shared_sd);
+	end.shared_sd6 = ho_index(map, fds, &nfds, shared_sd6);
+	end.members    = member_num;
+	for (i = 0; i < member_num; i++)
+		fds[nfds++] = members[i];
+
+	/* Room for all of it, the kernel adds overhead per message */
+	msgs = (nfds + HANDOVER_MAX_FDS - 1) / HANDOVER_MAX_FDS + (num + HANDOVER_BATCH - 1) / HANDOVER_BATCH + 1;
+	sz = msgs * (sizeof(struct ho_hdr) + 1024) + num * sizeof(*rec) + sizeof(end);
+	if (setsockopt(sd, SOL_SOCKET, SO_SNDBUFFORCE, &sz, sizeof(sz)))
+		setsockopt(sd, SOL_SOCKET, SO_SNDBUF, &sz, sizeof(sz));
+
+	logit(LOG_NOTICE, "Handing over %zu sockets and %zu interfaces ...", nfds, num);
+	for (i = 0; i < nfds; i += HANDOVER_MAX_FDS) {
+		if (ho_send(sd, HO_FDS, NULL, 0, 0, &fds[i], MIN(nfds - i, HANDOVER_MAX_FDS)))
+			goto fail;
+	}
+	for (i = 0; i < num; i += HANDOVER_BATCH) {
+		size_t n = MIN(num - i, HANDOVER_BATCH);
+
+		if (ho_send(sd, HO_IFS, &rec[i], n * sizeof(*rec), n, NULL, 0))
+			goto fail;
+	}
+	if (ho_send(sd, HO_END, &end, sizeof(end), 1, NULL, 0))
+		goto fail;
+
+	rc = 0;
+	goto done;
+fail:
+	logit(LOG_ERR, "Failed handover, continuing: %s", strerror(errno));
+done:
+	free(fds);
+	free(map);
+	free(rec);
+
+	return rc;
+}
+
+/* The new process has everything, stop without touching the sockets */
+void handover_done(void)
+{
+	logit(LOG_NOTICE, "Handover complete, exiting.");
+	running = 0;
+}
+
+static int ho_recv(int sd, struct ho_hdr *hdr, int **fds, size_t *nfds)
+{
+	char cbuf[CMSG_SPACE(HANDOVER_MAX_FDS * sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	size_t n = 0;
+
+	iov.iov_base = hdr;
+	iov.iov_len  = sizeof(*hdr);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	if (recvmsg(sd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(*hdr))
+		return -1;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		int *tmp;
 
-		if (mod && !ifs->mod)
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
 			continue;
-		ifs->mod = 0;
 
-//		send_search(ifs, "upnp:rootdevice");
-		for (i = 0; supported_types[i]; i++) {
-			/* UUID sent in SSDP_ST_ALL, first announce */
-			if (!strcmp(supported_types[i], uuid))
-				continue;
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		tmp = realloc(*fds, (*nfds + n) * sizeof(int));
+		if (!tmp) {
+			int *fd = (int *)CMSG_DATA(cmsg);
+
+			while (n--)
+				close(fd[n]);
+			return -1;
+		}
+		*fds = tmp;
+		memcpy(&(*fds)[*nfds], CMSG_DATA(cmsg), n * sizeof(int));
+		*nfds += n;
+	}
+
+	if (hdr->magic != HANDOVER_MAGIC || hdr->version != HANDOVER_VERSION ||
+	    hdr->size != sizeof(struct ho_ifs)) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	if (hdr->type == HO_FDS && hdr->num != n) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int ho_valid(int32_t idx, size_t nfds)
+{
+	return idx >= -1 && idx < (int32_t)nfds;
+}
+
+static int ho_fd(int *fds, int32_t idx)
+{
+	return idx == -1 ? -1 : fds[idx];
+}
+
+/*
+ * The receiving end of handover(), for -t.  Returns 1 if there is no
+ * ssdpd to take over from, 0 when all its sockets are ours, and -1 on
+ * error, then the old ssdpd keeps running.
+ */
+static int takeover_init(char *path)
+{
+	struct timeval tv = { HANDOVER_TIMEOUT, 0 };
+	struct ho_ifs *rec = NULL;
+	struct sockaddr_un sun;
+	struct ho_end end;
+	struct ho_hdr hdr;
+	int *fds = NULL;
+	size_t i, num = 0, nfds = 0;
+	int sd, rc = -1;
+
+	sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sd < 0)
+		return -1;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+	if (connect(sd, (struct sockaddr *)&sun, sizeof(sun))) {
+		logit(LOG_NOTICE, "No ssdpd running at %s, starting up normally.", path);
+		close(sd);
+		return 1;
+	}
+
+	setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (write(sd, "handover\n", 9) != 9)
+		goto fail;
+
+	while (1) {
+		if (ho_recv(sd, &hdr, &fds, &nfds))
+			goto fail;
+
+		if (hdr.type == HO_FDS)
+			continue;
+
+		if (hdr.type == HO_IFS) {
+			struct ho_ifs *tmp;
+			size_t len = hdr.num * sizeof(*rec);
 
-			send_message(ifs, supported_types[i], NULL);
+			if (hdr.num > HANDOVER_BATCH)
+				goto proto;
+
+			tmp = realloc(rec, (num + hdr.num) * sizeof(*rec));
+			if (!tmp)
+				goto fail;
+			rec = tmp;
+
+			if (recv(sd, &rec[num], len, MSG_WAITALL) != (ssize_t)len)
+				goto fail;
+			num += hdr.num;
+			continue;
 		}
+
+		if (hdr.type != HO_END)
+			goto proto;
+
+		if (recv(sd, &end, sizeof(end), MSG_WAITALL) != sizeof(end))
+			goto fail;
+		break;
+	}
+
+	/* Validate everything before using any of it */
+	for (i = 0; i < num; i++) {
+		if (!ho_valid(rec[i].in, nfds) || !ho_valid(rec[i].out, nfds))
+			goto proto;
+	}
+	if (end.sd < 0 || end.sd6 < 0 || !ho_valid(end.sd, nfds) || !ho_valid(end.sd6, nfds) ||
+	    !ho_valid(end.shared_sd, nfds) || !ho_valid(end.shared_sd6, nfds) || end.members > nfds)
+		goto proto;
+
+	end.uuid[sizeof(end.uuid) - 1] = 0;
+	end.server[sizeof(end.server) - 1] = 0;
+	strcpy(uuid, end.uuid);
+	strcpy(server_string, end.server);
+	if (shared != end.shared)
+		logit(LOG_NOTICE, "Keeping -s setting of the old ssdpd, restart fully to change it.");
+	shared     = end.shared;
+	mcast_sd   = ho_fd(fds, end.sd);
+	mcast_sd6  = ho_fd(fds, end.sd6);
+	shared_sd  = ho_fd(fds, end.shared_sd);
+	shared_sd6 = ho_fd(fds, end.shared_sd6);
+	for (i = nfds - end.members; i < nfds; i++) {
+		if (member_add(fds[i]))
+			goto fail;
+	}
+
+	/* New entries go first, so register in reverse to keep the order */
+	for (i = num; i > 0; i--) {
+		struct ho_ifs *r = &rec[i - 1];
+		struct ifsock *ifs;
+		int in = ho_fd(fds, r->in);
+
+		r->ifname[sizeof(r->ifname) - 1] = 0;
+		if (r->kind == HO_WEB)	/* Blocking, if from an older ssdpd */
+			fcntl(in, F_SETFL, fcntl(in, F_GETFL) | O_NONBLOCK);
+		if (r->kind == HO_CTL) {
+			if (ctl_adopt(in, path))
+				goto fail;
+		} else if (register_socket(in, ho_fd(fds, r->out), r->ifname[0] ? r->ifname : NULL,
+					   (struct sockaddr *)&r->addr, (struct sockaddr *)&r->mask,
+					   r->kind == HO_WEB ? web_recv : ssdp_recv))
+			goto fail;
+
+		ifs = IFS_NEWEST();
+		ifs->ifindex   = r->ifindex;
+		ifs->mod       = r->mod;
+		if (r->notify_at)
+			schedule(ifs, 0, r->notify_at);
+		ifs->stats     = r->stats;
+	}
+
+	if (write(sd, "y", 1) != 1)
+		goto fail;
+
+	logit(LOG_NOTICE, "Took over %zu sockets and %zu interfaces, uuid %s", nfds, num, uuid);
+	rc = 0;
+	goto done;
+proto:
+	errno = EPROTO;
+fail:
+	logit(LOG_ERR, "Failed taking over from running ssdpd: %s", strerror(errno));
+	for (i = 0; i < nfds; i++)
+		close(fds[i]);
+done:
+	close(sd);
+	free(rec);
+	free(fds);
+
+	return rc;
+}
+
+/*
+ * Interfaces announced from the snapshot at startup are not new to the
+ * LAN, so instead of another NOTIFY right away they start at a random
+ * phase in the interval.
+ */
+static void warm_init(uint64_t now)
+{
+	struct ifsock *ifs;
+
+	IFS_FOREACH(ifs) {
+		if (ifs->out != -1 && snap_announced(ifs))
+			schedule(ifs, now, now + 1 + rand() % (interval * 1000));
+	}
+}
+
+/*
+ * Periodic interface scan, also run right away at startup and reload.
+ * New interfaces are announced within NOTIFY_JITTER.
+ */
+static void rescan(void *arg, uint64_t now)
+{
+	static int first = 1;
+	struct ifsock *ifs;
+	int modified;
+
+	(void)arg;
+	modified = ssdp_init(mcast_sd, mcast_sd6, cur.ifaces, cur.ifnum);
+	if (warm && (first || resnap || modified > 0)) {
+		if (first)
+			warm_init(now);
+		snap_save(SNAP_FILE);
 	}
+	first = 0;
+	resnap = 0;
+
+	IFS_FOREACH(ifs) {
+		if (!ifs->notify.pending)
+			schedule(ifs, now, 0);
+	}
+
+	timer_start(&rescan_timer, now + refresh * 1000, rescan, NULL);
+}
+
+/*
+ * Every interface address has its own socket, so on hosts with many
+ * interfaces the default soft limit of 1024 descriptors is not enough.
+ */
+static void nofile_init(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl))
+		return;
+
+	if (rl.rlim_cur == rl.rlim_max)
+		return;
+
+	logit(LOG_DEBUG, "Raising max open files from %lu to %lu",
+	      (unsigned long)rl.rlim_cur, (unsigned long)rl.rlim_max);
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl))
+		logit(LOG_WARNING, "Failed raising max open files: %s", strerror(errno));
 }
 
 static void lsb_init(void)
@@ -1029,69 +1470,210 @@ static void uuidgen(void)
 	logit(LOG_DEBUG, "URN: %s", uuid);
 }
 
+/*
+ * Command line settings with the config file, if any, on top.  Only
+ * what changed is applied, no sockets are touched.  The interface scan
+ * that follows adds and removes interfaces, and rewrites the snapshot
+ * if either the interfaces or the identity changed.
+ */
+static int conf_apply(uint64_t now)
+{
+	struct conf conf = base;
+	struct ifsock *ifs;
+	int ident;
+
+	if (conf_file && conf_read(conf_file, &conf)) {
+		conf_free(&conf);
+		return -1;
+	}
+
+	/* A new device type replaces the old, tell control points it is gone */
+	if (strcmp(conf.device_type, device_type)) {
+		IFS_FOREACH(ifs)
+			send_byebye(ifs, device_type);
+	}
+
+	ident = strcmp(conf.device_type, device_type) ||
+		strcmp(conf.friendly_name, friendly_name) ||
+		strcmp(conf.manufacturer, manufacturer) ||
+		strcmp(conf.manufacturer_url, manufacturer_url) ||
+		strcmp(conf.model, model);
+	strcpy(device_type, conf.device_type);
+	strcpy(friendly_name, conf.friendly_name);
+	strcpy(manufacturer, conf.manufacturer);
+	strcpy(manufacturer_url, conf.manufacturer_url);
+	strcpy(model, conf.model);
+
+	/* A shorter interval must not leave NOTIFY scheduled further out */
+	if (conf.interval < interval) {
+		uint64_t ival = conf.interval * 1000;
+
+		IFS_FOREACH(ifs) {
+			if (ifs->notify.pending && ifs->notify.expires > now + ival)
+				schedule(ifs, now, now + 1 + rand() % ival);
+		}
+	}
+	interval = conf.interval;
+	refresh  = conf.refresh;
+	pps      = conf.pps;
+	bufmax   = conf.bufmax;
+
+	/* The registry and socket filter are set up for proxy mode at startup */
+	if (conf.upnum && !neighbors && mcast_sd != -1)
+		logit(LOG_WARNING, "Proxy mode needs -n, or upstream at startup, ignoring.");
+	memcpy(upstream, conf.upstream, sizeof(upstream));
+	upnum = conf.upnum;
+
+	conf_free(&cur);
+	cur = conf;
+
+	/* New identity, announce it within NOTIFY_JITTER */
+	if (ident) {
+		IFS_FOREACH(ifs)
+			schedule(ifs, now, 0);
+		resnap = 1;
+	}
+
+	return 0;
+}
+
 static void exit_handler(int signo)
 {
 	(void)signo;
 	running = 0;
 }
 
+static void reload_handler(int signo)
+{
+	(void)signo;
+	reload = 1;
+}
+
 static void signal_init(void)
 {
 	signal(SIGTERM, exit_handler);
 	signal(SIGINT,  exit_handler);
-	signal(SIGHUP,  exit_handler);
+	signal(SIGHUP,  reload_handler);
 	signal(SIGQUIT, exit_handler);
 }
 
+/* Command line number, the same ranges as in the config file */
+static int number(char *arg, int min, int max, int *out)
+{
+	char *end;
+	long num;
+
+	errno = 0;
+	num = strtol(arg, &end, 10);
+	if (errno || *end || end == arg || num < min || num > max)
+		return -1;
+	*out = num;
+
+	return 0;
+}
+
 static int usage(int code)
 {
-	printf("Usage: %s [-dhv] [-i SEC] [IFACE [IFACE ...]]\n"
+	printf("Usage: %s [-bdhnstvw] [-f FILE] [-i SEC] [-m NET] [-p PPS] [-q KIB] [-r SEC] [-u IFACE] [IFACE [IFACE ...]]\n"
 	       "\n"
+	       "    -b        Drop anything but SSDP requests in the kernel, with a socket filter\n"
 	       "    -d        Developer debug mode\n"
+	       "    -f FILE   Configuration file, re-read on SIGHUP\n"
 	       "    -h        This help text\n"
 	       "    -i SEC    SSDP notify interval (30-900), default %d sec\n"
+	       "    -m NET    Allow NET/LEN to read /metrics, loopback is always allowed\n"
+	       "    -n        Track SSDP neighbors, send M-SEARCH on new interfaces\n"
+	       "    -p PPS    Max NOTIFY packets/sec, 0 for no limit, default %d\n"
+	       "    -q KIB    Max socket buffer, grown when datagrams are dropped, default %d KiB\n"
 	       "    -r SEC    Interface refresh interval (5-1800), default %d sec\n"
+	       "    -s        Shared outbound socket per address family, not one per address\n"
+	       "    -t        Hot restart, take over all sockets from a running ssdpd\n"
+	       "    -u IFACE  Proxy mode, answer M-SEARCH on the others for devices on IFACE\n"
 	       "    -v        Show program version\n"
+	       "    -w        Warm start, announce from a snapshot of the last run at startup\n"
 	       "\n"
-	       "Bug report address: %-40s\n", PACKAGE_NAME, NOTIFY_INTERVAL, REFRESH_INTERVAL, PACKAGE_BUGREPORT);
+	       "Bug report address: %-40s\n", PACKAGE_NAME, NOTIFY_INTERVAL, NOTIFY_PPS, BUFFER_MAX, REFRESH_INTERVAL, PACKAGE_BUGREPORT);
 
 	return code;
 }
 
 int main(int argc, char *argv[])
 {
-	int i, c, sd, sd6;
+	int i, c, rc = 0;
 	int log_level = LOG_NOTICE;
 	int log_opts = LOG_CONS | LOG_PID;
-	int interval = NOTIFY_INTERVAL;
-	int refresh = REFRESH_INTERVAL;
-	time_t now, rtmo = 0, itmo = 0;
+	uint64_t now;
 
-	while ((c = getopt(argc, argv, "dhi:r:v")) != EOF) {
+	while ((c = getopt(argc, argv, "bdf:hi:m:np:q:r:stu:vw")) != EOF) {
 		switch (c) {
+		case 'b':
+			filter = 1;
+			break;
+
 		case 'd':
 			debug = 1;
 			break;
 
+		case 'f':
+			conf_file = optarg;
+			break;
+
 		case 'h':
 			return usage(0);
 
 		case 'i':
-			interval = atoi(optarg);
-			if (interval < 30 || interval > 900)
+			if (number(optarg, 30, 900, &interval))
 				errx(1, "Invalid announcement interval (30-900).");
 			break;
 
+		case 'm':
+			if (web_allow(optarg))
+				errx(1, "Invalid network %s, use NET/LEN", optarg);
+			break;
+
+		case 'n':
+			neighbors = 1;
+			break;
+
+		case 'p':
+			if (number(optarg, 0, NOTIFY_PPS_MAX, &pps))
+				errx(1, "Invalid NOTIFY packets/sec (0-%d).", NOTIFY_PPS_MAX);
+			break;
+
+		case 'q':
+			if (number(optarg, 0, 65536, &bufmax))
+				errx(1, "Invalid max socket buffer (0-65536 KiB).");
+			break;
+
 		case 'r':
-			refresh = atoi(optarg);
-			if (refresh < 5 || refresh > 1800)
+			if (number(optarg, 5, 1800, &refresh))
 				errx(1, "Invalid refresh interval (5-1800).");
 			break;
 
+		case 's':
+			shared = 1;
+			break;
+
+		case 't':
+			takeover = 1;
+			break;
+
+		case 'u':
+			if (base.upnum == UPSTREAM_MAX)
+				errx(1, "Too many upstream interfaces, max %d.", UPSTREAM_MAX);
+			if (strlen(optarg) >= sizeof(base.upstream[0]))
+				errx(1, "Invalid upstream interface %s.", optarg);
+			strcpy(base.upstream[base.upnum++], optarg);
+			break;
+
 		case 'v':
 			puts(PACKAGE_VERSION);
 			return 0;
 
+		case 'w':
+			warm = 1;
+			break;
+
 		default:
 			break;
 		}
@@ -1104,39 +1686,99 @@ int main(int argc, char *argv[])
                 log_opts |= LOG_PERROR;
 	}
 
-        openlog(PACKAGE_NAME, log_opts, LOG_DAEMON);
-        setlogmask(LOG_UPTO(log_level));
+	log_init(log_level, log_opts, debug);
+
+	base.interval = interval;
+	base.refresh  = refresh;
+	base.pps      = pps;
+	base.bufmax   = bufmax;
+	base.ifaces   = &argv[optind];
+	base.ifnum    = argc - optind;
+	strcpy(base.device_type, device_type);
+	strcpy(base.friendly_name, friendly_name);
+	strcpy(base.manufacturer, manufacturer);
+	strcpy(base.manufacturer_url, manufacturer_url);
+	strcpy(base.model, model);
+	if (conf_apply(timer_now()))
+		errx(1, "Failed reading configuration file %s", conf_file);
+
+	nofile_init();
+	timer_init();
+
+	/* Proxy mode learns the devices to answer for as neighbors */
+	if (upnum)
+		neighbors = 1;
+
+	if (neighbors && cache_init(CACHE_MAX_NEIGHBORS))
+		err(1, "Failed creating neighbor cache");
+
+	if (takeover) {
+		rc = takeover_init(CTL_SOCKET);
+		if (rc < 0)
+			errx(1, "Hot restart failed, the running ssdpd is left as-is.");
+	}
 
-	uuidgen();
-	lsb_init();
-	web_init();
+	if (!takeover || rc) {
+		uuidgen();
+		lsb_init();
+		web_init();
 
-	sd = multicast_init();
-	if (sd < 0)
-		err(1, "Failed creating multicast socket");
+		/* Announce from last time's snapshot, before the interface scan */
+		if (warm && snap_load(SNAP_FILE) > 0)
+			logit(LOG_NOTICE, "Warm start, %d interfaces announced from snapshot.", snap_announce());
 
-	sd6 = multicast_init6();
-	if (sd6 < 0)
-		err(1, "Failed creating multicast socket");
+		if (ctl_init(CTL_SOCKET))
+			logit(LOG_WARNING, "No control socket, ssdpctl will not work.");
 
-	while (running) {
-		now = time(NULL);
+		mcast_sd = multicast_init();
+		if (mcast_sd < 0)
+			err(1, "Failed creating multicast socket");
 
-		if (rtmo <= now) {
-			if (ssdp_init(sd, sd6, &argv[optind], argc - optind) > 0)
-				announce(1);
-			rtmo = now + refresh;
-		}
+		mcast_sd6 = multicast_init6();
+		if (mcast_sd6 < 0)
+			err(1, "Failed creating multicast socket");
+
+		if (shared && shared_init(mcast_sd6))
+			err(1, "Failed creating shared outbound socket");
+	}
+
+	/* Sockets taken over may have a filter, ours or none replaces it */
+	for (i = 0; i < 2; i++) {
+		int sd = i ? mcast_sd6 : mcast_sd;
+
+		if (filter)
+			filter_attach(sd, neighbors);
+		else if (takeover)
+			filter_detach(sd);
+	}
+	srand(time(NULL) ^ getpid());	/* NOTIFY jitter */
+
+	if (shm_init(SHM_FILE))
+		logit(LOG_WARNING, "No stats segment, ssdpctl stats will not work.");
+
+	timer_start(&rescan_timer, timer_now(), rescan, NULL);
+	while (running) {
+		now = timer_now();
 
-		if (itmo <= now) {
-			announce(0);
-			itmo = now + interval;
+		if (reload) {
+			reload = 0;
+			logit(LOG_NOTICE, "Reloading configuration ...");
+			if (!conf_apply(now))
+				timer_start(&rescan_timer, now, rescan, NULL);
 		}
 
-		wait_message(MIN(rtmo, itmo));
+		timer_run(now);
+		wait_message(timer_next());
 	}
 
-	closelog();
+	ctl_exit();
+	conn_exit();
+	shm_exit();
+	conf_free(&cur);
+	snap_exit();
+	filter_exit();
+	cache_exit();
+	log_exit();
 	return close_socket();
 }
 
@@ -0,0 +1,230 @@
+/* Millisecond timers, a hierarchical timer wheel on CLOCK_MONOTONIC
+ *
+ * Copyright (c) 2017  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.a
+ */
+
+#include <config.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "ssdp.h"
+
+/*
+ * Four levels of 64 slots.  Level 0 has one slot per msec, each level
+ * above covers 64 times more, so the wheel spans 64^4 msec, about 4.6
+ * hours.  Timers further out are parked in the top level and cascaded
+ * down, a level at a time, as their slot comes up.  Start and stop are
+ * O(1), and a bitmap per level finds the next deadline without walking
+ * the slots, so the main loop sleeps until there is work.
+ */
+#define BITS     6
+#define SLOTS    (1 << BITS)
+#define MASK     (SLOTS - 1)
+#define LEVELS   4
+#define SPAN(l)  ((uint64_t)1 << (BITS * (l)))
+
+LIST_HEAD(tlist, timer);
+
+static struct tlist wheel[LEVELS][SLOTS];
+static uint64_t     occupied[LEVELS];
+static uint64_t     base;		/* Next msec to run, all before are done */
+static size_t       num_timers;
+
+uint64_t timer_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Lowest level where expires is less than a full turn ahead of base */
+static void insert(struct timer *t)
+{
+	uint64_t at = t->expires;
+	int level;
+
+	if (at < base)
+		at = base;
+
+	for (level = 0; level < LEVELS - 1; level++) {
+		if ((at >> (BITS * level)) - (base >> (BITS * level)) < SLOTS)
+			break;
+	}
+	if ((at >> (BITS * level)) - (base >> (BITS * level)) >= SLOTS)
+		at = ((base >> (BITS * level)) + MASK) << (BITS * level);
+
+	t->level = level;
+	t->slot  = (at >> (BITS * level)) & MASK;
+	LIST_INSERT_HEAD(&wheel[level][t->slot], t, link);
+	occupied[level] |= (uint64_t)1 << t->slot;
+}
+
+static void unlink_timer(struct timer *t)
+{
+	LIST_REMOVE(t, link);
+	if (LIST_EMPTY(&wheel[t->level][t->slot]))
+		occupied[t->level] &= ~((uint64_t)1 << t->slot);
+}
+
+/* Start, or restart, timer to call cb(arg, now) at expires, msec */
+void timer_start(struct timer *t, uint64_t expires, void (*cb)(void *, uint64_t), void *arg)
+{
+	if (t->pending)
+		unlink_timer(t);
+	else
+		num_timers++;
+
+	t->expires = expires;
+	t->cb      = cb;
+	t->arg     = arg;
+	t->pending = 1;
+	insert(t);
+}
+
+void timer_stop(struct timer *t)
+{
+	if (!t->pending)
+		return;
+
+	unlink_timer(t);
+	t->pending = 0;
+	num_timers--;
+}
+
+/* Offset, in slots, to the first occupied slot at or after pos */
+static int first(uint64_t map, int pos)
+{
+	uint64_t rot;
+
+	rot = (map >> pos) | (pos ? map << (SLOTS - pos) : 0);
+
+	return __builtin_ctzll(rot);
+}
+
+/*
+ * Earliest msec at which there may be work, UINT64_MAX if no timer is
+ * running.  Exact for level 0, for the levels above it is when a slot
+ * is due to be cascaded, which is never later than its first timer.
+ */
+uint64_t timer_next(void)
+{
+	uint64_t next = UINT64_MAX;
+	int level;
+
+	if (!num_timers)
+		return next;
+
+	for (level = 0; level < LEVELS; level++) {
+		uint64_t slot, at;
+		int pos, off;
+
+		if (!occupied[level])
+			continue;
+
+		slot = base >> (BITS * level);
+		pos  = slot & MASK;
+		off  = first(occupied[level], pos);
+
+		at = (slot + off) << (BITS * level);
+		if (at < base)
+			at += SPAN(level + 1);
+
+		if (at < next)
+			next = at;
+	}
+
+	return next;
+}
+
+/* Re-insert all timers of a higher level slot, relative to the new base */
+static void cascade(int level)
+{
+	struct tlist *head = &wheel[level][(base >> (BITS * level)) & MASK];
+	struct timer *t;
+
+	occupied[level] &= ~((uint64_t)1 << ((base >> (BITS * level)) & MASK));
+	while ((t = LIST_FIRST(head))) {
+		LIST_REMOVE(t, link);
+		insert(t);
+	}
+}
+
+/*
+ * Run all timers due at or before now.  Callbacks may start and stop
+ * any timer, those started to expire at or before now run next call.
+ */
+void timer_run(uint64_t now)
+{
+	while (base <= now) {
+		struct tlist due;
+		struct timer *t;
+		uint64_t next;
+		int level;
+
+		next = timer_next();
+		if (next > now) {
+			base = now + 1;
+			break;
+		}
+		base = next;
+
+		for (level = LEVELS - 1; level > 0; level--) {
+			if (!(base & (SPAN(level) - 1)))
+				cascade(level);
+		}
+
+		/* Detach the slot, and move on, before calling anyone */
+		LIST_INIT(&due);
+		while ((t = LIST_FIRST(&wheel[0][base & MASK]))) {
+			LIST_REMOVE(t, link);
+			LIST_INSERT_HEAD(&due, t, link);
+		}
+		occupied[0] &= ~((uint64_t)1 << (base & MASK));
+		base++;
+
+		while ((t = LIST_FIRST(&due))) {
+			LIST_REMOVE(t, link);
+			t->pending = 0;
+			num_timers--;
+			t->cb(t->arg, now);
+		}
+	}
+}
+
+void timer_init(void)
+{
+	int level, slot;
+
+	for (level = 0; level < LEVELS; level++) {
+		for (slot = 0; slot < SLOTS; slot++)
+			LIST_INIT(&wheel[level][slot]);
+		occupied[level] = 0;
+	}
+	base = timer_now();
+	num_timers = 0;
+}
+
+size_t timer_count(void)
+{
+	return num_timers;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -22,6 +22,7 @@
 #include <ifaddrs.h>
 #include <netdb.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -42,7 +43,7 @@ const char *xml =
 	"   <minor>0</minor>\r\n"
 	" </specVersion>\r\n"
 	" <device>\r\n"
-	"  <deviceType>" DEVICE_TYPE "</deviceType>\r\n"
+	"  <deviceType>%s</deviceType>\r\n"
 	"  <friendlyName>%s</friendlyName>\r\n"
 	"  <manufacturer>%s</manufacturer>\r\n%s"
 	"  <modelName>%s</modelName>\r\n"
@@ -52,6 +53,275 @@ const char *xml =
 	"</root>\r\n"
 	"\r\n";
 
+/* Defaults from configure, can be changed in the config file */
+char friendly_name[64]     = "";	/* Empty for hostname */
+char manufacturer[64]      = MANUFACTURER;
+#ifdef MANUFACTURER_URL
+char manufacturer_url[128] = MANUFACTURER_URL;
+#else
+char manufacturer_url[128] = "";
+#endif
+char model[64]             = MODEL;
+
+/* Source networks allowed to read /metrics, loopback is always allowed */
+struct network {
+	int family;
+	int len;
+	union {
+		struct in_addr  in;
+		struct in6_addr in6;
+	} addr;
+};
+
+static struct network *allow;
+static size_t         allow_num;
+
+/* Add NET/LEN, or a single address, to the /metrics allow list */
+int web_allow(char *net)
+{
+	struct network *tmp, nw;
+	char buf[INET6_ADDRSTRLEN + 5], *ptr;
+	int max;
+
+	strncpy(buf, net, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = 0;
+	ptr = strchr(buf, '/');
+	if (ptr)
+		*ptr++ = 0;
+
+	memset(&nw, 0, sizeof(nw));
+	if (inet_pton(AF_INET, buf, &nw.addr.in) == 1) {
+		nw.family = AF_INET;
+		max = 32;
+	} else if (inet_pton(AF_INET6, buf, &nw.addr.in6) == 1) {
+		nw.family = AF_INET6;
+		max = 128;
+	} else {
+		errno = EINVAL;
+		return -1;
+	}
+
+	nw.len = ptr ? atoi(ptr) : max;
+	if (nw.len < 0 || nw.len > max) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	tmp = realloc(allow, (allow_num + 1) * sizeof(*allow));
+	if (!tmp)
+		return -1;
+
+	allow = tmp;
+	allow[allow_num++] = nw;
+
+	return 0;
+}
+
+static int prefix_match(const unsigned char *a, const unsigned char *b, int len)
+{
+	int bytes = len / 8, bits = len % 8;
+
+	if (memcmp(a, b, bytes))
+		return 0;
+	if (bits && ((a[bytes] ^ b[bytes]) & (0xff << (8 - bits))))
+		return 0;
+
+	return 1;
+}
+
+/* Check peer of accepted client against the /metrics allow list */
+static int allowed(int sd)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+	struct in_addr in;
+	struct in6_addr *in6 = NULL;
+	int family;
+	size_t i;
+
+	if (getpeername(sd, (struct sockaddr *)&ss, &len))
+		return 0;
+
+	if (ss.ss_family == AF_INET) {
+		in = ((struct sockaddr_in *)&ss)->sin_addr;
+		family = AF_INET;
+	} else if (ss.ss_family == AF_INET6) {
+		in6 = &((struct sockaddr_in6 *)&ss)->sin6_addr;
+		if (IN6_IS_ADDR_V4MAPPED(in6)) {
+			memcpy(&in, &in6->s6_addr[12], sizeof(in));
+			family = AF_INET;
+		} else {
+			family = AF_INET6;
+		}
+	} else {
+		return 0;
+	}
+
+	if (family == AF_INET && (ntohl(in.s_addr) >> 24) == IN_LOOPBACKNET)
+		return 1;
+	if (family == AF_INET6 && IN6_IS_ADDR_LOOPBACK(in6))
+		return 1;
+
+	for (i = 0; i < allow_num; i++) {
+		if (allow[i].family != family)
+			continue;
+
+		if (family == AF_INET &&
+		    prefix_match((unsigned char *)&allow[i].addr.in, (unsigned char *)&in, allow[i].len))
+			return 1;
+		if (family == AF_INET6 &&
+		    prefix_match(allow[i].addr.in6.s6_addr, in6->s6_addr, allow[i].len))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void counter(FILE *fp, const char *name, const char *help, size_t offset)
+{
+	char addr[INET6_ADDRSTRLEN];
+	struct ifsock *ifs;
+
+	fprintf(fp, "# HELP ssdpd_%s %s\n# TYPE ssdpd_%s counter\n", name, help, name);
+	IFS_FOREACH(ifs) {
+		if (ifs->out == -1)
+			continue;
+
+		if (ifs->addr.ss_family == AF_INET)
+			inet_ntop(AF_INET, &((struct sockaddr_in *)&ifs->addr)->sin_addr, addr, sizeof(addr));
+		else
+			inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&ifs->addr)->sin6_addr, addr, sizeof(addr));
+
+		fprintf(fp, "ssdpd_%s{interface=\"%s\",address=\"%s\"} %llu\n", name, ifs->ifname, addr,
+			*(unsigned long long *)((char *)&ifs->stats + offset));
+	}
+}
+
+#define COUNTER(fp, name, help, field) counter(fp, name, help, offsetof(struct ifstats, field))
+
+/* Label value, the device type is from the config file */
+static void label(FILE *fp, const char *str)
+{
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(fp, "\\%c", *str);
+		else if (*str == '\n')
+			fputs("\\n", fp);
+		else
+			fputc(*str, fp);
+	}
+}
+
+/*
+ * Reply latency per ST as a Prometheus histogram.  The buckets are cut
+ * at each power of two usec, where the log-linear ones line up.
+ */
+static void histogram(FILE *fp)
+{
+	uint64_t cum, floor;
+	struct hist *h;
+	int i, j;
+
+	fprintf(fp, "# HELP ssdpd_reply_latency_seconds M-SEARCH * received, by the kernel, to reply sent.\n"
+		"# TYPE ssdpd_reply_latency_seconds histogram\n");
+	for (i = 0; i < SSDP_TYPES; i++) {
+		h = &st_lat[i];
+		cum = 0;
+		for (j = 0; j < HIST_BUCKETS - 1; j++) {
+			cum += h->count[j];
+			floor = hist_floor(j + 1);
+			if (floor & (floor - 1))
+				continue;
+
+			fprintf(fp, "ssdpd_reply_latency_seconds_bucket{st=\"");
+			label(fp, supported_types[i]);
+			fprintf(fp, "\",le=\"%g\"} %llu\n", floor / 1e6, (unsigned long long)cum);
+		}
+		fprintf(fp, "ssdpd_reply_latency_seconds_bucket{st=\"");
+		label(fp, supported_types[i]);
+		fprintf(fp, "\",le=\"+Inf\"} %llu\n", (unsigned long long)h->num);
+
+		fprintf(fp, "ssdpd_reply_latency_seconds_sum{st=\"");
+		label(fp, supported_types[i]);
+		fprintf(fp, "\"} %g\n", h->sum / 1e6);
+		fprintf(fp, "ssdpd_reply_latency_seconds_count{st=\"");
+		label(fp, supported_types[i]);
+		fprintf(fp, "\"} %llu\n", (unsigned long long)h->num);
+	}
+}
+
+/* Prometheus text exposition format, version 0.0.4 */
+static void metrics(FILE *fp)
+{
+	uint64_t pass, drop;
+
+	COUNTER(fp, "received_packets_total", "SSDP packets received.", rx_pkts);
+	COUNTER(fp, "received_bytes_total", "SSDP bytes received.", rx_bytes);
+	COUNTER(fp, "sent_packets_total", "SSDP packets sent.", tx_pkts);
+	COUNTER(fp, "sent_bytes_total", "SSDP bytes sent.", tx_bytes);
+	COUNTER(fp, "msearch_total", "M-SEARCH * requests received.", msearch);
+	COUNTER(fp, "msearch_unsupported_total", "M-SEARCH * requests for an unsupported ST.", unsupported);
+	COUNTER(fp, "replies_total", "M-SEARCH * replies sent.", replies);
+	COUNTER(fp, "notify_total", "NOTIFY * announcements sent.", notify);
+	COUNTER(fp, "send_errors_total", "Failed SSDP sends.", send_err);
+
+	histogram(fp);
+
+	fprintf(fp, "# HELP ssdpd_msearch_dropped_total M-SEARCH * from clients not on any served subnet.\n"
+		"# TYPE ssdpd_msearch_dropped_total counter\n"
+		"ssdpd_msearch_dropped_total %llu\n", (unsigned long long)stats.no_iface);
+
+	fprintf(fp, "# HELP ssdpd_http_requests_total HTTP requests to the built-in web server.\n"
+		"# TYPE ssdpd_http_requests_total counter\n"
+		"ssdpd_http_requests_total{code=\"200\"} %llu\n"
+		"ssdpd_http_requests_total{code=\"400\"} %llu\n"
+		"ssdpd_http_requests_total{code=\"403\"} %llu\n"
+		"ssdpd_http_requests_total{code=\"404\"} %llu\n",
+		(unsigned long long)stats.http_ok,
+		(unsigned long long)stats.http_bad_request,
+		(unsigned long long)stats.http_forbidden,
+		(unsigned long long)stats.http_not_found);
+
+	fprintf(fp, "# HELP ssdpd_socket_events_total Readable sockets handled.\n"
+		"# TYPE ssdpd_socket_events_total counter\n"
+		"ssdpd_socket_events_total %llu\n", (unsigned long long)stats.events);
+	fprintf(fp, "# HELP ssdpd_socket_empty_reads_total Readable sockets with nothing to read.\n"
+		"# TYPE ssdpd_socket_empty_reads_total counter\n"
+		"ssdpd_socket_empty_reads_total %llu\n", (unsigned long long)stats.empty_reads);
+	fprintf(fp, "# HELP ssdpd_socket_lost_total Datagrams dropped by the kernel, receive queue full.\n"
+		"# TYPE ssdpd_socket_lost_total counter\n"
+		"ssdpd_socket_lost_total %llu\n", (unsigned long long)stats.rx_drops);
+	if (upnum)
+		fprintf(fp, "# HELP ssdpd_proxy_replies_total M-SEARCH * replies for neighbors on upstream interfaces.\n"
+			"# TYPE ssdpd_proxy_replies_total counter\n"
+			"ssdpd_proxy_replies_total %llu\n", (unsigned long long)stats.proxied);
+	if (!filter_count(&pass, &drop))
+		fprintf(fp, "# HELP ssdpd_filter_datagrams_total Datagrams seen by the socket filter on the multicast sockets.\n"
+			"# TYPE ssdpd_filter_datagrams_total counter\n"
+			"ssdpd_filter_datagrams_total{verdict=\"pass\"} %llu\n"
+			"ssdpd_filter_datagrams_total{verdict=\"drop\"} %llu\n",
+			(unsigned long long)pass, (unsigned long long)drop);
+
+	fprintf(fp, "# HELP ssdpd_interface_table_entries Entries in the interface table, listening sockets included.\n"
+		"# TYPE ssdpd_interface_table_entries gauge\n"
+		"ssdpd_interface_table_entries %zu\n", ift.num);
+	fprintf(fp, "# HELP ssdpd_interface_table_bytes Heap used by the interface table.\n"
+		"# TYPE ssdpd_interface_table_bytes gauge\n"
+		"ssdpd_interface_table_bytes %zu\n", socket_memory());
+
+	fprintf(fp, "# HELP ssdpd_neighbors Devices in the neighbor registry.\n"
+		"# TYPE ssdpd_neighbors gauge\n"
+		"ssdpd_neighbors %zu\n", cache_count());
+}
+
+static void send_metrics(FILE *fp)
+{
+	fputs("HTTP/1.1 200 OK\r\n"
+	      "Content-Type: text/plain; version=0.0.4\r\n"
+	      "Connection: close\r\n"
+	      "\r\n", fp);
+	metrics(fp);
+}
 
 /* Peek into SOCK_STREAM on accepted client socket to figure out inbound interface */
 static struct sockaddr *stream_peek(int sd, char *ifname)
@@ -100,95 +370,181 @@ static struct sockaddr *stream_peek(int sd, char *ifname)
 	return (struct sockaddr *) &ss;
 }
 
-static void respond(int sd, struct sockaddr *sin)
+/* Render device description XML for the server address sa, an AF_INET6 socket */
+/* Element text, the identity is from the config file */
+static char *escape(const char *str, char *buf, size_t len)
 {
-	char *head = "HTTP/1.1 200 OK\r\n"
-		"Content-Type: text/xml\r\n"
-		"Connection: close\r\n"
-		"\r\n";
-	char hostname[64], url[128] = "";
+	size_t i = 0;
+
+	for (; *str && i + 7 < len; str++) {
+		switch (*str) {
+		case '&':
+			i += sprintf(&buf[i], "&amp;");
+			break;
+		case '<':
+			i += sprintf(&buf[i], "&lt;");
+			break;
+		case '>':
+			i += sprintf(&buf[i], "&gt;");
+			break;
+		case '"':
+			i += sprintf(&buf[i], "&quot;");
+			break;
+		case '\'':
+			i += sprintf(&buf[i], "&apos;");
+			break;
+		default:
+			buf[i++] = *str;
+			break;
+		}
+	}
+	buf[i] = 0;
+
+	return buf;
+}
+
+int web_render(FILE *fp, struct sockaddr *sa)
+{
+	char type[6 * sizeof(device_type)], name[6 * sizeof(friendly_name)];
+	char vendor[6 * sizeof(manufacturer)], href[6 * sizeof(manufacturer_url)];
+	char product[6 * sizeof(model)];
+	char hostname[64], url[sizeof(href) + 64] = "";
 	char ip6[INET6_ADDRSTRLEN];
-	char mesg[1024], *reqline[3];
-	int rcvd, fd, bytes_read;
 	struct sockaddr_in6 *sin6;
 
-	memset(mesg, 0, sizeof(mesg));
-	rcvd = recv(sd, mesg, sizeof(mesg), 0);
-	if (rcvd <= 0) {
-		logit(LOG_WARNING, "web recv() error: %s", strerror(errno));
-		goto error;
+	if (friendly_name[0])
+		strcpy(hostname, friendly_name);
+	else if (gethostname(hostname, sizeof(hostname)))
+		hostname[0] = 0;
+	hostname[sizeof(hostname) - 1] = 0;
+	if (manufacturer_url[0])
+		snprintf(url, sizeof(url), "  <manufacturerURL>%s</manufacturerURL>\r\n",
+			 escape(manufacturer_url, href, sizeof(href)));
+
+	sin6 = (struct sockaddr_in6 *) sa;
+	if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+		struct in_addr *addr = ((struct in_addr *) (sin6->sin6_addr.s6_addr+12));
+		inet_ntop(AF_INET, addr, ip6, sizeof(ip6));
+	}
+	else {
+		inet_ntop(AF_INET6, &sin6->sin6_addr, ip6, sizeof(ip6));
 	}
 
-	logit(LOG_DEBUG, "%s", mesg);
+	return fprintf(fp, xml,
+		       escape(device_type, type, sizeof(type)),
+		       escape(hostname, name, sizeof(name)),
+		       escape(manufacturer, vendor, sizeof(vendor)),
+		       url,
+		       escape(model, product, sizeof(product)),
+		       uuid,
+		       ip6);
+}
+
+/*
+ * Reply to the request in mesg, rendered to fp.  The whole reply is
+ * queued and then sent as the client reads it, see conn.c.
+ */
+static void respond(int sd, char *mesg, struct sockaddr *sin, FILE *fp)
+{
+	char *head = "HTTP/1.1 200 OK\r\n"
+		"Content-Type: text/xml\r\n"
+		"Connection: close\r\n"
+		"\r\n";
+	char *reqline[3];
+	int code = 0;
+
 	reqline[0] = strtok(mesg, " \t\n");
-	if (strncmp(reqline[0], "GET", 4) == 0) {
+	if (reqline[0] && strncmp(reqline[0], "GET", 4) == 0) {
 		reqline[1] = strtok(NULL, " \t");
 		reqline[2] = strtok(NULL, " \t\n");
-		if (strncmp(reqline[2], "HTTP/1.0", 8) != 0 && strncmp(reqline[2], "HTTP/1.1", 8) != 0) {
-			if (write(sd, "HTTP/1.1 400 Bad Request\r\n", 26) < 0)
-				logit(LOG_WARNING, "Failed returning status 400 to client: %s", strerror(errno));
-			goto error;
+		logit(LOG_DEBUG, "GET %s %s", reqline[1], reqline[2]);
+		if (!reqline[1] || !reqline[2] ||
+		    (strncmp(reqline[2], "HTTP/1.0", 8) != 0 && strncmp(reqline[2], "HTTP/1.1", 8) != 0)) {
+			stats.http_bad_request++;
+			code = 400;
+			fputs("HTTP/1.1 400 Bad Request\r\n", fp);
+			goto done;
+		}
+
+		if (!strcmp(reqline[1], LOCATION_METRICS)) {
+			if (!allowed(sd)) {
+				stats.http_forbidden++;
+				code = 403;
+				fputs("HTTP/1.1 403 Forbidden\r\n", fp);
+				goto done;
+			}
+
+			stats.http_ok++;
+			code = 200;
+			send_metrics(fp);
+			goto done;
 		}
 
 		/* XXX: Add support for icon as well */
 		if (!strstr(reqline[1], LOCATION_DESC)) {
-			if (write(sd, "HTTP/1.1 404 Not Found\r\n", 24) < 0)
-				logit(LOG_WARNING, "Failed returning status 404 to client: %s", strerror(errno));
-			goto error;
+			stats.http_not_found++;
+			code = 404;
+			fputs("HTTP/1.1 404 Not Found\r\n", fp);
+			goto done;
 		}
 
-		gethostname(hostname, sizeof(hostname));
-#ifdef MANUFACTURER_URL
-		snprintf(url, sizeof(url), "  <manufacturerURL>%s</manufacturerURL>\r\n", MANUFACTURER_URL);
-#endif
-		logit(LOG_DEBUG, "Sending XML reply ...");
-		send(sd, head, strlen(head), 0);
+		stats.http_ok++;
+		code = 200;
 
-		sin6 = (struct sockaddr_in6 *) sin;
-		if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
-			struct in_addr *addr = ((struct in_addr *) (sin6->sin6_addr.s6_addr+12));
-			inet_ntop(AF_INET, addr, ip6, sizeof(ip6));
-		}
-		else {
-			inet_ntop(AF_INET6, &sin6->sin6_addr, ip6, sizeof(ip6));
-		}
-		snprintf(mesg, sizeof(mesg), xml,
-			 hostname,
-			 MANUFACTURER,
-			 url,
-			 MODEL,
-			 uuid,
-			 ip6);
-		if (send(sd, mesg, strlen(mesg), 0) < 0)
-			logit(LOG_WARNING, "Failed sending file to client: %s", strerror(errno));
+		logit(LOG_DEBUG, "Sending XML reply ...");
+		fputs(head, fp);
+		web_render(fp, sin);
 	}
 
-error:
-	shutdown(sd, SHUT_RDWR);
-	close(sd);
+done:
+	TRACE2(http_end, sd, code);
 }
 
-void web_recv(int sd)
+/* Called as the request comes in, it is complete at the empty line */
+static int web_input(struct conn *c)
 {
-	int client;
 	char ifname[IF_NAMESIZE] = "UNKNOWN";
 	struct sockaddr *sin;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *fp;
 
-	client = accept(sd, NULL, NULL);
-	if (client < 0) {
-		logit(LOG_ERR, "accept() error: %s", strerror(errno));
-		return;
-	}
+	if (!strstr(c->req, "\r\n\r\n") && !strstr(c->req, "\n\n"))
+		return 1;
 
-	sin = stream_peek(client, ifname);
+	sin = stream_peek(c->sd, ifname);
 	if (!sin) {
 		logit(LOG_ERR, "Failed resolving client interface: %s", strerror(errno));
+		return -1;
+	}
+
+	fp = open_memstream(&buf, &len);
+	if (!fp) {
+		logit(LOG_WARNING, "Failed rendering reply: %s", strerror(errno));
+		return -1;
+	}
+	respond(c->sd, c->req, sin, fp);
+	fclose(fp);
+	conn_reply(c, buf, len);
+
+	return 0;
+}
+
+void web_recv(int sd)
+{
+	int client;
+
+	client = accept4(sd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (client < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			stats.empty_reads++;
+		else
+			logit(LOG_ERR, "accept() error: %s", strerror(errno));
 		return;
 	}
 
-	respond(client, sin);
-	shutdown(client, SHUT_RDWR);
-	close(client);
+	TRACE1(http_start, client);
+	conn_add(client, web_input, NULL);
 }
 
 void web_init4(void)
@@ -203,7 +559,7 @@ void web_init4(void)
 	sin->sin_addr.s_addr = htonl(INADDR_ANY);
 	sin->sin_port = htons(LOCATION_PORT);
 
-	sd = socket(sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	sd = socket(sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if (sd == -1)
 		err(1, "Failed creating web socket");
 
@@ -218,7 +574,7 @@ void web_init4(void)
 	if (listen(sd, 10) != 0)
 		err(1, "Failed setting web listen backlog");
 
-	register_socket(sd, -1, &sa, NULL, web_recv);
+	register_socket(sd, -1, NULL, &sa, NULL, web_recv);
 }
 
 void web_init6(void)
@@ -226,7 +582,7 @@ void web_init6(void)
 	int sd;
 	struct sockaddr_in6 serveraddr;
 
-	sd = socket(AF_INET6, SOCK_STREAM, 0);
+	sd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if (sd == -1)
 		err(1, "Failed creating web socket");
 
@@ -247,7 +603,7 @@ void web_init6(void)
 	if (listen(sd, 10) != 0)
 		err(1, "Failed setting web listen backlog");
 
-	register_socket(sd, -1, (struct sockaddr *)&serveraddr, NULL, web_recv);
+	register_socket(sd, -1, NULL, (struct sockaddr *)&serveraddr, NULL, web_recv);
 }
 
 void web_init(void)